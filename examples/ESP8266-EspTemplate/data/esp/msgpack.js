@@ -0,0 +1,101 @@
+// MessagePack decoder for the binary WebSocket frames of EspSetup::WebSocketSendJson()
+// Usage: connection.binaryType='arraybuffer'; obj=EspMsgPack.parse(e.data);
+// Covers all types ArduinoJson writes, ext types are returned as null
+var EspMsgPack=(function(){
+'use strict';
+function decode(buffer)
+{
+var view=new DataView(buffer);
+var pos=0;
+function str(len)
+{
+var s=new TextDecoder('utf-8').decode(new Uint8Array(buffer,pos,len));
+pos+=len;
+return s;
+}
+function bin(len)
+{
+var b=new Uint8Array(buffer.slice(pos,pos+len));
+pos+=len;
+return b;
+}
+function arr(len)
+{
+var a=new Array(len);
+for(var i=0;i<len;i++)a[i]=next();
+return a;
+}
+function map(len)
+{
+var o={};
+for(var i=0;i<len;i++){var k=next();o[k]=next();}
+return o;
+}
+function u64()
+{
+var v=view.getUint32(pos)*4294967296+view.getUint32(pos+4);
+pos+=8;
+return v;
+}
+function i64()
+{
+var v=view.getInt32(pos)*4294967296+view.getUint32(pos+4);
+pos+=8;
+return v;
+}
+function next()
+{
+var t=view.getUint8(pos++),v;
+if(t<0x80)return t;
+if(t<0x90)return map(t&0x0f);
+if(t<0xa0)return arr(t&0x0f);
+if(t<0xc0)return str(t&0x1f);
+if(t>=0xe0)return t-0x100;
+switch(t)
+{
+case 0xc0:return null;
+case 0xc2:return false;
+case 0xc3:return true;
+case 0xc4:v=view.getUint8(pos);pos+=1;return bin(v);
+case 0xc5:v=view.getUint16(pos);pos+=2;return bin(v);
+case 0xc6:v=view.getUint32(pos);pos+=4;return bin(v);
+case 0xca:v=view.getFloat32(pos);pos+=4;return v;
+case 0xcb:v=view.getFloat64(pos);pos+=8;return v;
+case 0xcc:v=view.getUint8(pos);pos+=1;return v;
+case 0xcd:v=view.getUint16(pos);pos+=2;return v;
+case 0xce:v=view.getUint32(pos);pos+=4;return v;
+case 0xcf:return u64();
+case 0xd0:v=view.getInt8(pos);pos+=1;return v;
+case 0xd1:v=view.getInt16(pos);pos+=2;return v;
+case 0xd2:v=view.getInt32(pos);pos+=4;return v;
+case 0xd3:return i64();
+case 0xd9:v=view.getUint8(pos);pos+=1;return str(v);
+case 0xda:v=view.getUint16(pos);pos+=2;return str(v);
+case 0xdb:v=view.getUint32(pos);pos+=4;return str(v);
+case 0xdc:v=view.getUint16(pos);pos+=2;return arr(v);
+case 0xdd:v=view.getUint32(pos);pos+=4;return arr(v);
+case 0xde:v=view.getUint16(pos);pos+=2;return map(v);
+case 0xdf:v=view.getUint32(pos);pos+=4;return map(v);
+case 0xd4:pos+=2;return null;
+case 0xd5:pos+=3;return null;
+case 0xd6:pos+=5;return null;
+case 0xd7:pos+=9;return null;
+case 0xd8:pos+=17;return null;
+case 0xc7:v=view.getUint8(pos);pos+=2+v;return null;
+case 0xc8:v=view.getUint16(pos);pos+=3+v;return null;
+case 0xc9:v=view.getUint32(pos);pos+=5+v;return null;
+}
+throw new Error('msgpack: bad type 0x'+t.toString(16));
+}
+return next();
+}
+// object of a binary or JSON text message, null for anything else (plain text)
+function parse(data)
+{
+var obj;
+try{obj=(data instanceof ArrayBuffer)?decode(data):JSON.parse(data);}
+catch(err){return null;}
+return (obj!==null&&typeof obj==='object')?obj:null;
+}
+return {decode:decode,parse:parse};
+})();
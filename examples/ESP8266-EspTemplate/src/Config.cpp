@@ -17,11 +17,10 @@ void Config::Setup()
     MqttUSER = "mqtt_usr";
     MqttPASS = "mqtt_pwd";
     useMqtt = true;
-    Device *dev = new Device();
-    dev->Uuid = "Hue01";
-    dev->Name = "Rainbow";
-    DeviceList.push_back(dev);
     WriteConfig();
+    if (!esp.GetFS()->exists(DEVICESFILEPATH)) {
+      Devices.Add("Hue01", "Rainbow");
+    }
   }
   Done = ReadConfig();
   if (!Done) {
@@ -29,22 +28,6 @@ void Config::Setup()
   }
 }
 
-Device* Config::FindDeviceUuid(const String &uuid)
-{
-  for (Device *device : DeviceList) {
-    if (device->Uuid == uuid) return device;
-  }
-  return nullptr;
-}
-
-Device* Config::FindDeviceName(const String &name)
-{
-  for (Device *device : DeviceList) {
-    if (device->Name == name) return device;
-  }
-  return nullptr;
-}
-
 bool Config::ReadConfig()
 {
   DynamicJsonDocument doc(8192);
@@ -70,25 +53,32 @@ bool Config::ReadConfig()
     if (obj.containsKey("UseMqtt")) useMqtt = obj["UseMqtt"];
     if (UseMqtt()) CONSOLE.println("Mqtt is active");
 
-    int cnt = 0;
-    if (obj.containsKey("DeviceList")) {
+    if (!Devices.Load() && obj.containsKey("DeviceList")) {
+      // configuration of an older version, move the devices to the registry
+      int cnt = 0;
       for (const JsonObject dev_obj : obj["DeviceList"].as<JsonArray>())
       {
-        Device *dev = new Device();
-        dev->Uuid = (dev_obj.containsKey("Uuid")) ? dev_obj["Uuid"].as<String>() : String(cnt);
-        if (dev_obj.containsKey("Name")) dev->Name = dev_obj["Name"].as<String>();
-        DeviceList.push_back(dev);
+        String uuid = (dev_obj.containsKey("Uuid")) ? dev_obj["Uuid"].as<String>() : String(cnt);
+        Devices.Add(uuid, dev_obj["Name"].as<String>());
         cnt++;
       }
+      if (Devices.Compact()) {
+        WriteConfig();
+      } else {
+        // keep the DeviceList and drop the lines Add() appended, the migration runs again
+        CONSOLE.println("failed writing the device registry, migration postponed");
+        esp.GetFS()->remove(DEVICESFILEPATH);
+        esp.GetFS()->remove(DEVICESFILEPATH FILE_BAK_EXT);
+      }
     }
-    CONSOLE.printf("found %d devices\n\r", cnt);
+    CONSOLE.printf("found %u devices\n\r", (unsigned) Devices.Count());
   }
   return ret;
 }
 
 bool Config::WriteConfig()
 {
-  DynamicJsonDocument doc(8192);
+  StaticJsonDocument<512> doc;
 
   doc["Config"] = "Config";
   doc["Version"] = 1.0;
@@ -99,11 +89,6 @@ bool Config::WriteConfig()
   doc["MqttPASS"] = MqttPASS;
   doc["UseMqtt"] = UseMqtt();
 
-  JsonArray dev_list = doc.createNestedArray("DeviceList");
-  for (Device *device : DeviceList) {
-    JsonObject dev = dev_list.createNestedObject();
-    dev["Uuid"]     = device->Uuid;
-    dev["Name"]     = device->Name;
-  }
+  // devices are kept by the registry (DEVICESFILEPATH)
   return esp.WriteFile(CONFIGFILEPATH, doc);
 }
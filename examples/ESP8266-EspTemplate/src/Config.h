@@ -7,18 +7,18 @@
 
 #pragma once
 #include <EspSetup.h>
+#include <EspRegistry.h>
 
 #define CONSOLE Serial  // Serial, Telnet or NoDebug to disable debugging
 #define CONFIGFILEPATH "/esp/config.json"
+#define DEVICESFILEPATH "/esp/devices.json"   // device registry journal
+#define MAX_DEVICES 64
 
-class Device
+class Device : public RegistryDevice
 {
 public:
   Device() = default;
   virtual ~Device() = default;
-
-  String Uuid;
-  String Name;
 };
 
 class Config
@@ -32,10 +32,10 @@ class Config
 
   bool UseMqtt() const { return useMqtt && MqttIP4 != "" && MqttPORT != 0; }
 
-  const std::vector<Device*> getDeviceList() { return  DeviceList; }
+  DeviceRegistry<Device, MAX_DEVICES>& getDeviceList() { return Devices; }
 
-  Device* FindDeviceUuid(const String &uuid);
-  Device* FindDeviceName(const String &name);
+  Device* FindDeviceUuid(const String &uuid) { return Devices.FindUuid(uuid); }
+  Device* FindDeviceName(const String &name) { return Devices.FindName(name); }
   
   String MqttIP4;
   int    MqttPORT = 0;
@@ -49,7 +49,7 @@ class Config
   bool Done = false;
   bool useMqtt = false;
 
-  std::vector<Device*> DeviceList;
+  DeviceRegistry<Device, MAX_DEVICES> Devices{DEVICESFILEPATH};
 };
 
 extern Config cfg;
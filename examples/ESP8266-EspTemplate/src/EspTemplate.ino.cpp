@@ -24,22 +24,16 @@ void getValues(const char* pJson) {
   }
 }
 
-String replyString(bool all) {
-  StaticJsonDocument<256> doc;
-  
+void replyValues(JsonDocument &doc, bool all) {
   doc["time"] = String(ntp.getDateTimeString());
   if (all) doc["text"] = text;
   doc["slid"] = second();
-
-  String conf;
-  serializeJson(doc, conf);
-  return conf;
 }
 
 void ws_callback_fn(uint8_t num, WStype_t type, const uint8_t *payload, size_t len) {
   if (type == WStype_TEXT) {
     CONSOLE.printf("[%u] got Text: %s\n", num, payload);
-    if (len >= 8 && !strncmp((const char*) payload, "EspTemplate", 8)) { esp.WebSocketSend(num, replyString(true)); }
+    if (len >= 8 && !strncmp((const char*) payload, "EspTemplate", 8)) { StaticJsonDocument<256> doc; replyValues(doc, true); esp.WebSocketSendJson(num, doc); }
     else if (len > 4 && !strncmp((const char*) payload, "Save", 4))   { getValues((char*) &payload[4]); esp.WriteFile(EspTemplateFile, (const char*) &payload[4]); }
     else if (len >= 6 && !strncmp((const char*) payload, "Reboot", 6)) { ESP.reset(); }
   }
@@ -62,6 +56,15 @@ void setup() {
   
   cfg.Setup();    // example for additional project configuration
 
+  // MQTT connects in the background and reconnects on its own
+  if (cfg.UseMqtt()) {
+    esp.Mqtt().Subscribe("EspTemplate/text", [](const char *topic, const uint8_t *payload, size_t len) {
+      text = "";
+      text.concat((const char*) payload, len);   // payload is not zero terminated
+    });
+    esp.Mqtt().Begin(cfg.MqttIP4, cfg.MqttPORT, cfg.MqttUSER, cfg.MqttPASS, esp.GetDeviceName());
+  }
+
   // register the web server uris you want to manage by your own
   esp.on("/", HTTP_GET, []() {
     if (esp.CheckWebServerCredentials()) {  // optional credential check eo access the page
@@ -89,7 +92,9 @@ void loop() {
   if (last != curr) {
     last = curr;
     // update example web page exery second
-    esp.WebSocketBroadcast(replyString(false));
+    StaticJsonDocument<256> doc;
+    replyValues(doc, false);
+    esp.WebSocketBroadcastJson(doc);    // MessagePack to pages that asked for it, JSON text to the others
   }
   //esp.DeepSleep(1000);
 }
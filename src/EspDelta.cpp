@@ -0,0 +1,142 @@
+//=======================================================================
+// EspDelta.cpp Arduino EspSetup library ESP8266 / ESP32
+// Streaming decoder for delta firmware updates (tools/espdelta.py)
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+
+#include <string.h>
+#include "EspDelta.h"
+
+#define OP_END    0x00
+#define OP_COPY   0x01
+#define OP_DIFF   0x02
+#define OP_INSERT 0x03
+
+bool DeltaDecoder::Write(const uint8_t *pData, size_t len) {
+  uint32_t v;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t b = pData[i];
+    switch (state) {
+      case S_HEADER:
+        header[headerLen++] = b;
+        if (headerLen == DELTA_HEADER_SIZE) {
+          if (memcmp(header, DELTA_MAGIC, 4) || header[4] != DELTA_VERSION) return fail();
+          if (headerFn && !headerFn(*this)) return fail();
+          state = S_OP;
+        }
+        break;
+      case S_OP:
+        op = b;
+        if (op == OP_END) {
+          if (!flush() || outTotal != NewSize()) return fail();
+          state = S_DONE;
+        } else if (op == OP_COPY || op == OP_DIFF) {
+          state = S_SEEK;
+        } else if (op == OP_INSERT) {
+          state = S_LEN;
+        } else {
+          return fail();
+        }
+        break;
+      case S_SEEK:
+        if (readVarint(b, v)) {
+          // zigzag decoding of the signed seek
+          oldPos += (v >> 1) ^ (0 - (v & 1));
+          state = S_LEN;
+        }
+        break;
+      case S_LEN:
+        if (readVarint(b, v)) {
+          remain = v;
+          if (outTotal + remain > NewSize()) return fail();
+          if (remain == 0) {
+            state = S_OP;
+          } else if (op == OP_COPY) {
+            if (!copy(remain)) return fail();
+            state = S_OP;
+          } else {
+            state = (op == OP_DIFF) ? S_DIFF_ZEROS : S_INSERT;
+          }
+        }
+        break;
+      case S_DIFF_ZEROS:
+        if (readVarint(b, v)) {
+          if (v > remain || !copy(v)) return fail();
+          remain -= v;
+          state = remain ? S_DIFF_COUNT : S_OP;
+        }
+        break;
+      case S_DIFF_COUNT:
+        count = b;
+        if (count > remain) return fail();
+        state = count ? S_DIFF_BYTES : S_DIFF_ZEROS;
+        break;
+      case S_DIFF_BYTES: {
+        uint8_t o;
+        if (!oldByte(o) || !emit(o + b)) return fail();
+        remain--;
+        if (--count == 0) {
+          state = remain ? S_DIFF_ZEROS : S_OP;
+        }
+        break;
+      }
+      case S_INSERT:
+        if (!emit(b)) return fail();
+        if (--remain == 0) {
+          state = S_OP;
+        }
+        break;
+      case S_DONE:                  // trailing data
+      case S_ERROR:
+        return fail();
+    }
+  }
+  return true;
+}
+
+/*
+   Collect LEB128 bytes, returns true and the value when the last byte has been read
+*/
+bool DeltaDecoder::readVarint(uint8_t b, uint32_t &rValue) {
+  varint |= (uint32_t) (b & 0x7F) << shift;
+  shift += 7;
+  if ((b & 0x80) && shift < 35) return false;
+  rValue = varint;
+  varint = 0;
+  shift = 0;
+  return true;
+}
+
+bool DeltaDecoder::oldByte(uint8_t &b) {
+  if (oldPos >= OldSize()) return false;
+  uint32_t base = oldPos & ~(uint32_t) (DELTA_BLOCK_SIZE - 1);
+  if (base != cacheBase) {
+    if (!readFn(base, (uint8_t*) cache, DELTA_BLOCK_SIZE)) return false;
+    cacheBase = base;
+  }
+  b = ((const uint8_t*) cache)[oldPos - base];
+  oldPos++;
+  return true;
+}
+
+bool DeltaDecoder::copy(uint32_t len) {
+  uint8_t b;
+  while (len--) {
+    if (!oldByte(b) || !emit(b)) return false;
+  }
+  return true;
+}
+
+bool DeltaDecoder::emit(uint8_t b) {
+  out[outLen++] = b;
+  outTotal++;
+  return (outLen < DELTA_BLOCK_SIZE) || flush();
+}
+
+bool DeltaDecoder::flush() {
+  bool ret = (outLen == 0) || writeFn(out, outLen);
+  outLen = 0;
+  return ret;
+}
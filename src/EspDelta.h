@@ -0,0 +1,79 @@
+//=======================================================================
+// EspDelta.h Arduino EspSetup library ESP8266 / ESP32
+// Streaming decoder for delta firmware updates (tools/espdelta.py)
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+
+// Patch format, all numbers little endian, varints are LEB128 encoded:
+//   header  "ESPD" version(1) oldSize(u32) oldMd5[16] newSize(u32) newMd5[16]
+//   COPY    0x01 seek(zigzag varint) len(varint)          new = old[pos .. pos+len]
+//   DIFF    0x02 seek(zigzag varint) len(varint) groups   new = old[pos+i] + diff[i]
+//           groups: zeros(varint) count(u8) diff[count] ... until len is covered,
+//                   zeros are diff bytes of value 0 (plain copies) and not stored
+//   INSERT  0x03 len(varint) data[len]                    new = data
+//   END     0x00
+// seek moves the read position in the old image relative to the end of the previous
+// COPY/DIFF, so the patch can be applied in a single pass while it is received.
+
+#define DELTA_MAGIC "ESPD"
+#define DELTA_VERSION 1
+#define DELTA_HEADER_SIZE 45
+#define DELTA_BLOCK_SIZE 256      // old image read cache and output buffer size
+
+class DeltaDecoder
+{
+public:
+  typedef std::function<bool(uint32_t offset, uint8_t *pData, size_t len)> OldReadFn;  // offset and len are DELTA_BLOCK_SIZE aligned
+  typedef std::function<bool(const uint8_t *pData, size_t len)> NewWriteFn;
+  typedef std::function<bool(const DeltaDecoder &decoder)> HeaderFn;                   // return false to reject the patch
+
+  DeltaDecoder(OldReadFn read, NewWriteFn write, HeaderFn header = nullptr) : readFn(read), writeFn(write), headerFn(header) {}
+
+  bool Write(const uint8_t *pData, size_t len);   // feed patch bytes in any portions, false on error
+  bool Done() const { return state == S_DONE; }
+  bool Failed() const { return state == S_ERROR; }
+
+  uint32_t OldSize() const { return getU32(&header[5]); }
+  const uint8_t* OldMd5() const { return &header[9]; }
+  uint32_t NewSize() const { return getU32(&header[25]); }
+  const uint8_t* NewMd5() const { return &header[29]; }
+  uint32_t Written() const { return outTotal; }
+
+private:
+  enum State { S_HEADER, S_OP, S_SEEK, S_LEN, S_DIFF_ZEROS, S_DIFF_COUNT, S_DIFF_BYTES, S_INSERT, S_DONE, S_ERROR };
+
+  static uint32_t getU32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24); }
+  bool readVarint(uint8_t b, uint32_t &rValue);
+  bool oldByte(uint8_t &b);
+  bool emit(uint8_t b);
+  bool flush();
+  bool copy(uint32_t len);
+  bool fail() { state = S_ERROR; return false; }
+
+  OldReadFn  readFn;
+  NewWriteFn writeFn;
+  HeaderFn   headerFn;
+
+  State    state = S_HEADER;
+  uint8_t  header[DELTA_HEADER_SIZE];
+  size_t   headerLen = 0;
+  uint8_t  op = 0;
+  uint32_t varint = 0;
+  uint8_t  shift = 0;
+  uint32_t remain = 0;          // bytes left of the current operation
+  uint8_t  count = 0;           // diff bytes left of the current group
+  uint32_t oldPos = 0;
+
+  uint32_t cache[DELTA_BLOCK_SIZE / 4];   // word aligned for flash reads
+  uint32_t cacheBase = UINT32_MAX;
+  uint8_t  out[DELTA_BLOCK_SIZE];
+  size_t   outLen = 0;
+  uint32_t outTotal = 0;
+};
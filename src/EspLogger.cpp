@@ -0,0 +1,215 @@
+//=======================================================================
+// EspLogger.cpp Arduino EspSetup library ESP8266 / ESP32
+// Time-series data logger with fixed size records in rotating segment files
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+
+#include <cmath>
+#include "EspSetup.h"
+#include "EspLogger.h"
+
+extern Stream *pEspConsole;
+
+DataLogger::DataLogger(const char *pName, const char *pChannels)
+  : name(pName), dir(String(LOG_DIR) + "/" + pName)
+{
+  String list = pChannels;
+  int start = 0;
+  while (start <= (int) list.length() && channels.size() < LOG_CHANNELS_MAX) {
+    int end = list.indexOf(',', start);
+    if (end < 0) end = list.length();
+    channels.push_back(list.substring(start, end));
+    start = end + 1;
+  }
+}
+
+DataLogger::~DataLogger()
+{
+  Flush();
+  delete[] pBuf;
+}
+
+String DataLogger::segmentPath(uint32_t seq) const
+{
+  char file[10];
+  sprintf(file, "/%08x", (unsigned int) seq);
+  return dir + file;
+}
+
+bool DataLogger::Begin(FS *pFS)
+{
+  fs = pFS;
+  bufSize = (LOG_BUFFER_SIZE / RecordSize()) * RecordSize();
+  if (!pBuf) pBuf = new uint8_t[bufSize];
+  bufLen = 0;
+
+  // whole blocks per segment, appends never share a block with an older segment
+  FSInfo info;
+  size_t block = (fs->info(info) && info.blockSize) ? info.blockSize : 4096;
+  segmentSize = (block * LOG_SEGMENT_BLOCKS / RecordSize()) * RecordSize();
+
+  fs->mkdir(dir);
+  bool found = false;
+  Dir d = fs->openDir(dir);
+  while (d.next()) {
+    uint32_t seq = strtoul(d.fileName().c_str(), nullptr, 16);
+    if (!found || seq < firstSeq) firstSeq = seq;
+    if (!found || seq >= lastSeq) {
+      lastSeq = seq;
+      segmentFill = d.fileSize();
+    }
+    found = true;
+  }
+  if (!found) {
+    firstSeq = lastSeq = 0;
+    segmentFill = 0;
+  } else if (segmentFill % RecordSize()) {
+    rotate();                                   // torn record of a power loss, never append behind it
+  }
+  flushMillis = millis();
+  pEspConsole->printf("Logger %s: segments %u..%u\n", name.c_str(), (unsigned int) firstSeq, (unsigned int) lastSeq);
+  return true;
+}
+
+bool DataLogger::Log(const float *pValues)
+{
+  if (!pBuf) return false;
+  if (bufLen + RecordSize() > bufSize && !Flush()) {
+    return false;
+  }
+  uint32_t t = ntp.isValid() ? ntp.UtcTime() : 0;
+  memcpy(&pBuf[bufLen], &t, sizeof(t));
+  memcpy(&pBuf[bufLen + sizeof(t)], pValues, channels.size() * sizeof(float));
+  bufLen += RecordSize();
+  return true;
+}
+
+void DataLogger::rotate()
+{
+  lastSeq++;
+  segmentFill = 0;
+  while (lastSeq - firstSeq >= LOG_SEGMENT_COUNT) {
+    fs->remove(segmentPath(firstSeq++));
+  }
+}
+
+bool DataLogger::Flush()
+{
+  flushMillis = millis();
+  size_t pos = 0;
+  while (pos < bufLen) {
+    if (segmentFill >= segmentSize) rotate();
+    size_t len = std::min(bufLen - pos, segmentSize - segmentFill);
+    File file = fs->open(segmentPath(lastSeq), "a");
+    bool opened = file;
+    size_t written = opened ? file.write(&pBuf[pos], len) : 0;
+    file.close();
+    if (written != len) {
+      pEspConsole->printf("Logger %s: write failed\n", name.c_str());
+      // keep the records that are not written completely for the next try, a torn
+      // record at the end of the segment is skipped by Query()
+      pos += written / RecordSize() * RecordSize();
+      memmove(pBuf, &pBuf[pos], bufLen - pos);
+      bufLen -= pos;
+      // only a short write to an open segment leaves a torn record behind, never
+      // rotate for a segment that could not be opened: repeated failures would push
+      // out all older segments
+      if (opened && written % RecordSize()) {
+        rotate();
+      } else {
+        segmentFill += written;
+      }
+      return false;
+    }
+    segmentFill += len;
+    pos += len;
+  }
+  bufLen = 0;
+  return true;
+}
+
+void DataLogger::Loop()
+{
+  if (bufLen && millis() - flushMillis > LOG_FLUSH_INTERVAL) {
+    Flush();
+  }
+}
+
+// time of the first record of a segment, 0 if it does not exist
+uint32_t DataLogger::firstTime(uint32_t seq) const
+{
+  uint32_t t = 0;
+  File file = fs->open(segmentPath(seq), "r");
+  if (file) {
+    file.read((uint8_t*) &t, sizeof(t));
+    file.close();
+  }
+  return t;
+}
+
+/*
+   Records are in time order, segments ending before from are skipped by the time of
+   the following segment's first record. Records logged before the first NTP sync
+   (time 0) are returned for from = 0 only.
+*/
+size_t DataLogger::Query(Print &out, time_t from, time_t to, bool json)
+{
+  Flush();
+  size_t count = 0;
+  uint8_t rec[sizeof(uint32_t) + LOG_CHANNELS_MAX * sizeof(float)];
+  size_t recSize = RecordSize();
+  if (json) {
+    out.print('[');
+  } else {
+    out.print("time");
+    for (const String &channel : channels) {
+      out.print(',');
+      out.print(channel);
+    }
+    out.print('\n');
+  }
+  for (uint32_t seq = firstSeq; seq <= lastSeq; seq++) {
+    if (seq < lastSeq) {
+      uint32_t next = firstTime(seq + 1);
+      if (next != 0 && (time_t) next < from) continue;
+    }
+    File file = fs->open(segmentPath(seq), "r");
+    if (!file) continue;
+    while (file.read(rec, recSize) == recSize) {
+      uint32_t t;
+      memcpy(&t, rec, sizeof(t));
+      if ((time_t) t < from) continue;
+      if ((time_t) t > to) {
+        file.close();
+        seq = lastSeq;                          // done
+        break;
+      }
+      if (json) {
+        out.print(count ? ",{\"t\":" : "{\"t\":");
+        out.print(t);
+      } else {
+        out.print(ntp.getIsoDateTimeString(t, "Z"));
+      }
+      for (size_t i = 0; i < channels.size(); i++) {
+        float value;
+        memcpy(&value, &rec[sizeof(t) + i * sizeof(float)], sizeof(value));
+        if (json) {
+          out.print(",\"");
+          out.print(channels[i]);
+          out.print("\":");
+        } else {
+          out.print(',');
+        }
+        if (!std::isfinite(value)) out.print(json ? "null" : "");   // print() writes nan or inf
+        else out.print(value, 3);
+      }
+      out.print(json ? "}" : "\n");
+      count++;
+    }
+    file.close();
+  }
+  if (json) out.print("]");
+  return count;
+}
@@ -0,0 +1,62 @@
+//=======================================================================
+// EspLogger.h Arduino EspSetup library ESP8266 / ESP32
+// Time-series data logger with fixed size records in rotating segment files
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <vector>
+
+#define LOG_DIR "/log"                // segments of a logger are kept in LOG_DIR/<name>/
+#define LOG_CHANNELS_MAX 16           // values per record
+#define LOG_BUFFER_SIZE 512           // records collected in RAM before they are appended
+#define LOG_FLUSH_INTERVAL 60000      // ms, buffered records are appended at least this often
+#define LOG_SEGMENT_BLOCKS 4          // segment size in file system blocks
+#define LOG_SEGMENT_COUNT 8           // segments kept, the oldest one is deleted
+
+/*
+   A record is the UTC time (NTP, 0 until the first sync) followed by one float per
+   channel. Records are collected in RAM and appended to the current segment file in
+   one write, a segment holds LOG_SEGMENT_BLOCKS file system blocks worth of records.
+   Full segments are never written again, the oldest ones are deleted as a whole, so
+   no file is ever rewritten and writes are spread over the flash.
+*/
+class DataLogger
+{
+public:
+  DataLogger(const char *pName, const char *pChannels);  // channel names comma separated e.g. "temp,hum"
+  virtual ~DataLogger();
+
+  bool Begin(FS *pFS);                  // find the existing segments, called by EspSetup::AddLogger()
+  bool Log(const float *pValues);       // one value per channel
+  bool Log(float value) { return Log(&value); }
+  bool Flush();                         // append the buffered records, called before DeepSleep()
+  void Loop();                          // flushes every LOG_FLUSH_INTERVAL, called by EspSetup::Loop()
+  size_t Query(Print &out, time_t from, time_t to, bool json);   // records within [from, to] as CSV or JSON
+
+  const String& Name() const { return name; }
+  int Channels() const { return channels.size(); }
+  size_t RecordSize() const { return sizeof(uint32_t) + channels.size() * sizeof(float); }
+
+private:
+  String segmentPath(uint32_t seq) const;
+  uint32_t firstTime(uint32_t seq) const;
+  void rotate();
+
+  FS      *fs = nullptr;
+  String   name;
+  String   dir;
+  std::vector<String> channels;
+  uint8_t *pBuf = nullptr;
+  size_t   bufSize = 0;                 // whole records
+  size_t   bufLen = 0;
+  uint32_t firstSeq = 0;                // oldest segment
+  uint32_t lastSeq = 0;                 // segment appended to
+  size_t   segmentSize = 0;             // bytes, whole records
+  size_t   segmentFill = 0;             // bytes in the last segment
+  uint32_t flushMillis = 0;
+};
@@ -0,0 +1,500 @@
+//=======================================================================
+// EspMqtt.cpp Arduino EspSetup library ESP8266 / ESP32
+// Non-blocking MQTT 3.1.1 client driven by EspSetup::Loop()
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+
+#include <ESP8266WiFi.h>
+#include "EspMqtt.h"
+
+extern Stream *pEspConsole;
+
+#define ENTRY_HEADER 5      // queue entry: len u16, flags u8, id u16
+
+#define MQTT_CONNECT     0x10
+#define MQTT_CONNACK     0x20
+#define MQTT_PUBLISH     0x30
+#define MQTT_PUBACK      0x40
+#define MQTT_SUBSCRIBE   0x82
+#define MQTT_SUBACK      0x90
+#define MQTT_PINGREQ     0xC0
+#define MQTT_PINGRESP    0xD0
+#define MQTT_DISCONNECT  0xE0
+
+static uint8_t* putString(uint8_t *p, const char *s, size_t len) {
+  *p++ = len >> 8;
+  *p++ = len & 0xFF;
+  memcpy(p, s, len);
+  return p + len;
+}
+
+MqttService::~MqttService()
+{
+  End();
+}
+
+/*
+   The broker is given by IP address, a DNS lookup would block Loop().
+*/
+bool MqttService::Begin(const String &host, uint16_t port, const String &user, const String &pass, const String &clientId) {
+  End();
+  if (!ip.fromString(host) || port == 0) {
+    pEspConsole->println("MQTT: broker IP address or port invalid");
+    return false;
+  }
+  this->port = port;
+  this->user = user;
+  this->pass = pass;
+  this->clientId = clientId.isEmpty() ? "ESP_" + String(ESP.getChipId(), HEX) : clientId;
+  if (!pQueue) pQueue = new uint8_t[MQTT_QUEUE_SIZE];
+  if (!pRx) pRx = new uint8_t[MQTT_PACKET_MAX];
+  if (!pBatch) pBatch = new uint8_t[MQTT_BATCH_SIZE];
+  qHead = qTail = qSend = 0;
+  backoff = MQTT_BACKOFF_MIN;
+  state = S_BACKOFF;
+  timer = millis() - backoff;   // connect on the next Loop()
+  return true;
+}
+
+void MqttService::End() {
+  if (state == S_CONNECTED) {
+    uint8_t packet[2] = { MQTT_DISCONNECT, 0 };
+    client.write(packet, 2);
+  }
+  disconnect();
+  state = S_IDLE;
+  delete[] pQueue;
+  delete[] pRx;
+  delete[] pBatch;
+  pQueue = pRx = pBatch = nullptr;
+}
+
+void MqttService::disconnect() {
+  client.stop();
+  rxLen = rxNeed = rxSkip = 0;
+  pingPending = false;
+}
+
+void MqttService::fail() {
+  disconnect();
+  stats.failures++;
+  if (state == S_CONNECTED) {
+    pEspConsole->println("MQTT: connection lost");
+    backoff = MQTT_BACKOFF_MIN;
+  } else {
+    backoff = (backoff * 2 > MQTT_BACKOFF_MAX) ? MQTT_BACKOFF_MAX : backoff * 2;
+  }
+  state = S_BACKOFF;
+  timer = millis();
+}
+
+void MqttService::Loop() {
+  switch (state) {
+    case S_IDLE:
+      return;
+    case S_BACKOFF:
+      if (millis() - timer >= backoff && !connect()) {
+        fail();
+      }
+      return;
+    case S_CONNACK:
+      receive();
+      if (state == S_CONNACK && millis() - timer > MQTT_REPLY_TIMEOUT) {
+        pEspConsole->println("MQTT: no CONNACK");
+        fail();
+      }
+      return;
+    case S_CONNECTED:
+      if (!client.connected()) {
+        fail();
+        return;
+      }
+      receive();
+      if (state != S_CONNECTED) return;
+      if (pingPending && millis() - timer > MQTT_REPLY_TIMEOUT) {
+        pEspConsole->println("MQTT: no PINGRESP");
+        fail();
+        return;
+      }
+      if (!pingPending && millis() - lastSend > MQTT_KEEPALIVE * 750UL) {
+        uint8_t packet[2] = { MQTT_PINGREQ, 0 };
+        client.write(packet, 2);
+        lastSend = timer = millis();
+        pingPending = true;
+      }
+      send();
+      release();
+      return;
+  }
+}
+
+/*
+   TCP connect (bounded by MQTT_CONNECT_TIMEOUT) and CONNECT, CONNACK is awaited by Loop()
+*/
+bool MqttService::connect() {
+  client.setTimeout(MQTT_CONNECT_TIMEOUT);
+  if (!client.connect(ip, port)) return false;
+  client.setNoDelay(true);                       // packets are batched by send()
+
+  size_t len = 10 + 2 + clientId.length();
+  uint8_t flags = 0x02;                          // clean session
+  if (!user.isEmpty()) { flags |= 0x80; len += 2 + user.length(); }
+  if (!pass.isEmpty()) { flags |= 0x40; len += 2 + pass.length(); }
+  if (len + 2 > MQTT_BATCH_SIZE || len > 127 * 128) return false;
+
+  uint8_t *p = pBatch;
+  *p++ = MQTT_CONNECT;
+  if (len < 128) {
+    *p++ = len;
+  } else {
+    *p++ = (len & 0x7F) | 0x80;
+    *p++ = len >> 7;
+  }
+  p = putString(p, "MQTT", 4);
+  *p++ = 4;                                      // protocol level 3.1.1
+  *p++ = flags;
+  *p++ = MQTT_KEEPALIVE >> 8;
+  *p++ = MQTT_KEEPALIVE & 0xFF;
+  p = putString(p, clientId.c_str(), clientId.length());
+  if (flags & 0x80) p = putString(p, user.c_str(), user.length());
+  if (flags & 0x40) p = putString(p, pass.c_str(), pass.length());
+  if (client.write(pBatch, p - pBatch) != (size_t) (p - pBatch)) return false;
+
+  lastSend = timer = millis();
+  state = S_CONNACK;
+  return true;
+}
+
+/*
+   Append a packet of remaining length len to the queue, returns where the variable
+   header goes or nullptr if the queue is full
+*/
+uint8_t* MqttService::reserve(uint8_t header, size_t len, uint8_t flags, uint16_t id) {
+  if (!pQueue || len >= 16384) return nullptr;
+  size_t total = 1 + (len < 128 ? 1 : 2) + len;
+  if (qTail + ENTRY_HEADER + total > MQTT_QUEUE_SIZE && qHead > 0) {
+    memmove(pQueue, &pQueue[qHead], qTail - qHead);
+    qTail -= qHead;
+    qSend -= qHead;
+    qHead = 0;
+  }
+  if (qTail + ENTRY_HEADER + total > MQTT_QUEUE_SIZE) return nullptr;
+  uint8_t *p = &pQueue[qTail];
+  *p++ = total & 0xFF;
+  *p++ = total >> 8;
+  *p++ = flags;
+  *p++ = id & 0xFF;
+  *p++ = id >> 8;
+  *p++ = header;
+  if (len < 128) {
+    *p++ = len;
+  } else {
+    *p++ = (len & 0x7F) | 0x80;
+    *p++ = len >> 7;
+  }
+  qTail += ENTRY_HEADER + total;
+  return p;
+}
+
+/*
+   Messages are queued while the broker is not connected and sent after the
+   (re)connect. QoS 1 messages stay queued until the broker confirmed them.
+*/
+bool MqttService::Publish(const char *topic, const uint8_t *payload, size_t len, uint8_t qos, bool retain) {
+  size_t topicLen = strlen(topic);
+  uint16_t id = 0;
+  if (qos) {
+    id = nextId++;
+    if (nextId == 0) nextId = 1;
+  }
+  uint8_t header = MQTT_PUBLISH | (qos ? 0x02 : 0) | (retain ? 0x01 : 0);
+  uint8_t *p = reserve(header, 2 + topicLen + (qos ? 2 : 0) + len, qos ? F_QOS1 : 0, id);
+  if (!p) {
+    stats.dropped++;
+    return false;
+  }
+  p = putString(p, topic, topicLen);
+  if (qos) {
+    *p++ = id >> 8;
+    *p++ = id & 0xFF;
+  }
+  memcpy(p, payload, len);
+  stats.published++;
+  return true;
+}
+
+bool MqttService::Subscribe(const char *filter, MqttCallbackFn pFunction, uint8_t qos) {
+  if (callbackList.size() >= 255) return false;
+  int node = 0;
+  if (trie.empty()) trie.push_back(Node());      // root
+  String rest = filter;
+  while (true) {
+    int slash = rest.indexOf('/');
+    node = addNode(node, slash < 0 ? rest : rest.substring(0, slash));
+    if (slash < 0) break;
+    rest = rest.substring(slash + 1);
+  }
+  trie[node].callbacks.push_back(callbackList.size());
+  callbackList.push_back(pFunction);
+  filterList.push_back(filter);
+  qosList.push_back(qos ? 1 : 0);
+  return state != S_CONNECTED || subscribe(filterList.size() - 1);
+}
+
+int MqttService::addNode(int parent, const String &level) {
+  int last = -1;
+  for (int c = trie[parent].child; c >= 0; c = trie[c].next) {
+    if (trie[c].level == level) return c;
+    last = c;
+  }
+  Node node;
+  node.level = level;
+  trie.push_back(node);
+  int index = trie.size() - 1;
+  if (last < 0) trie[parent].child = index;
+  else trie[last].next = index;
+  return index;
+}
+
+bool MqttService::subscribe(size_t index) {
+  const String &filter = filterList[index];
+  uint16_t id = nextId++;
+  if (nextId == 0) nextId = 1;
+  uint8_t *p = reserve(MQTT_SUBSCRIBE, 2 + 2 + filter.length() + 1, 0, id);
+  if (!p) return false;
+  *p++ = id >> 8;
+  *p++ = id & 0xFF;
+  p = putString(p, filter.c_str(), filter.length());
+  *p = qosList[index];
+  return true;
+}
+
+/*
+   Coalesce queued packets into one write as far as the TCP window allows
+*/
+void MqttService::send() {
+  int room = client.availableForWrite();
+  if (room > MQTT_BATCH_SIZE) room = MQTT_BATCH_SIZE;
+  size_t n = 0;
+  while (qSend < qTail) {
+    uint8_t *pEntry = &pQueue[qSend];
+    size_t len = pEntry[0] | (pEntry[1] << 8);
+    if (!(pEntry[2] & F_SENT)) {
+      if (len > (size_t) MQTT_BATCH_SIZE) {
+        // too large for the batch, write it on its own when the window is empty
+        if (n || client.availableForWrite() < (int) len) break;
+        if (client.write(&pEntry[ENTRY_HEADER], len) != len) break;
+      } else {
+        if (n + len > (size_t) room) break;
+        memcpy(&pBatch[n], &pEntry[ENTRY_HEADER], len);
+        n += len;
+      }
+      pEntry[2] |= F_SENT;
+      if ((pEntry[ENTRY_HEADER] & 0xF0) == MQTT_PUBLISH) stats.sent++;
+      lastSend = millis();
+    }
+    qSend += ENTRY_HEADER + len;
+  }
+  if (n) client.write(pBatch, n);
+}
+
+size_t MqttService::entrySize(size_t q) const {
+  return ENTRY_HEADER + (pQueue[q] | (pQueue[q + 1] << 8));
+}
+
+// sent and, for QoS 1, acknowledged
+bool MqttService::done(size_t q) const {
+  uint8_t flags = pQueue[q + 2];
+  return (flags & F_SENT) && (!(flags & F_QOS1) || (flags & F_ACKED));
+}
+
+/*
+   Free sent entries, QoS 1 messages only when acknowledged. Messages still waiting
+   for their PUBACK are moved together so they do not hold back the entries behind them.
+*/
+void MqttService::release() {
+  size_t q = qHead;
+  while (q < qSend && done(q)) {
+    q += entrySize(q);
+  }
+  qHead = q;
+  size_t keep = q;                               // end of the kept entries
+  while (q < qSend) {
+    size_t size = entrySize(q);
+    if (!done(q)) {
+      if (keep != q) memmove(&pQueue[keep], &pQueue[q], size);
+      keep += size;
+    }
+    q += size;
+  }
+  if (keep != q) {
+    memmove(&pQueue[keep], &pQueue[q], qTail - q);
+    qTail -= q - keep;
+    qSend = keep;
+  }
+  if (qHead == qTail) {
+    qHead = qTail = qSend = 0;
+  }
+}
+
+void MqttService::receive() {
+  while (client.available() > 0) {
+    if (rxSkip) {
+      uint8_t dummy[32];
+      int n = client.read(dummy, rxSkip < sizeof(dummy) ? rxSkip : sizeof(dummy));
+      if (n <= 0) return;
+      rxSkip -= n;
+      continue;
+    }
+    if (rxNeed == 0) {
+      // fixed header: type and up to 4 bytes remaining length
+      int c = client.read();
+      if (c < 0) return;
+      pRx[rxLen++] = c;
+      if (rxLen > 1 && !(c & 0x80)) {
+        size_t len = 0;
+        for (size_t i = rxLen - 1; i > 0; i--) len = (len << 7) | (pRx[i] & 0x7F);
+        if (rxLen + len > MQTT_PACKET_MAX) {
+          rxSkip = len;
+          rxLen = 0;
+        } else {
+          rxNeed = rxLen + len;
+        }
+      } else if (rxLen == 5) {
+        pEspConsole->println("MQTT: malformed packet");
+        fail();
+        return;
+      }
+    } else {
+      int n = client.read(&pRx[rxLen], rxNeed - rxLen);
+      if (n <= 0) return;
+      rxLen += n;
+    }
+    if (rxNeed && rxLen == rxNeed) {
+      size_t header = 2;
+      while (pRx[header - 1] & 0x80) header++;
+      size_t len = rxNeed - header;
+      rxLen = rxNeed = 0;
+      handle(pRx[0], &pRx[header], len);
+      if (state == S_IDLE || state == S_BACKOFF) return;
+    }
+  }
+}
+
+void MqttService::handle(uint8_t header, uint8_t *pData, size_t len) {
+  switch (header & 0xF0) {
+    case MQTT_CONNACK:
+      if (state != S_CONNACK || len < 2 || pData[1] != 0) {
+        pEspConsole->printf("MQTT: connect refused (%d)\n", len >= 2 ? pData[1] : -1);
+        fail();
+        return;
+      }
+      state = S_CONNECTED;
+      stats.connects++;
+      backoff = MQTT_BACKOFF_MIN;
+      pEspConsole->printf("MQTT: connected to %s:%u\n", ip.toString().c_str(), port);
+      requeue();
+      for (size_t i = 0; i < filterList.size(); i++) {
+        subscribe(i);
+      }
+      return;
+    case MQTT_PUBLISH: {
+      if (len < 2) return;
+      size_t topicLen = (pData[0] << 8) | pData[1];
+      size_t pos = 2 + topicLen;
+      uint8_t qos = (header >> 1) & 0x03;
+      if (qos > 1) {                             // subscriptions ask for QoS 1 at most
+        pEspConsole->println("MQTT: QoS 2 not supported");
+        fail();
+        return;
+      }
+      if (pos + (qos ? 2 : 0) > len) return;
+      if (qos) {
+        uint8_t *p = reserve(MQTT_PUBACK, 2, 0, 0);
+        if (p) {
+          p[0] = pData[pos];
+          p[1] = pData[pos + 1];
+        }
+        pos += 2;
+      }
+      // move the topic in front of its length field to zero terminate it
+      memmove(pData, &pData[2], topicLen);
+      pData[topicLen] = 0;
+      stats.received++;
+      dispatch((const char*) pData, &pData[pos], len - pos);
+      return;
+    }
+    case MQTT_PUBACK:
+      if (len >= 2) {
+        uint16_t id = (pData[0] << 8) | pData[1];
+        for (size_t q = qHead; q < qSend; q += ENTRY_HEADER + (pQueue[q] | (pQueue[q + 1] << 8))) {
+          if ((pQueue[q + 2] & F_QOS1) && (pQueue[q + 3] | (pQueue[q + 4] << 8)) == id) {
+            if (!(pQueue[q + 2] & F_ACKED)) stats.acked++;
+            pQueue[q + 2] |= F_ACKED;
+            break;
+          }
+        }
+      }
+      return;
+    case MQTT_PINGRESP:
+      pingPending = false;
+      return;
+    default:                                     // SUBACK and others are not evaluated
+      return;
+  }
+}
+
+/*
+   After a reconnect unconfirmed QoS 1 messages are sent again with the DUP flag,
+   QoS 0 messages already written are lost with the connection.
+*/
+void MqttService::requeue() {
+  for (size_t q = qHead; q < qTail; q += ENTRY_HEADER + (pQueue[q] | (pQueue[q + 1] << 8))) {
+    uint8_t &flags = pQueue[q + 2];
+    if ((flags & F_QOS1) && !(flags & F_ACKED) && (flags & F_SENT)) {
+      flags &= ~F_SENT;
+      pQueue[q + ENTRY_HEADER] |= 0x08;
+    }
+  }
+  qSend = qHead;
+}
+
+void MqttService::dispatch(const char *topic, const uint8_t *payload, size_t len) {
+  if (!trie.empty()) {
+    match(0, topic, topic, payload, len);
+  }
+}
+
+/*
+   Walk the filter trie level by level, + matches one level, # the rest of the topic
+   including its parent level. Wildcards do not match topics starting with $.
+*/
+void MqttService::match(int node, const char *level, const char *topic, const uint8_t *payload, size_t len) {
+  const char *end = strchr(level, '/');
+  size_t n = end ? (size_t) (end - level) : strlen(level);
+  bool wild = !(level == topic && *topic == '$');
+  for (int c = trie[node].child; c >= 0; c = trie[c].next) {
+    const String &filter = trie[c].level;
+    if (filter == "#") {
+      if (wild) call(c, topic, payload, len);
+    } else if ((filter == "+" && wild) || (filter.length() == n && !strncmp(filter.c_str(), level, n))) {
+      if (end) {
+        match(c, end + 1, topic, payload, len);
+      } else {
+        call(c, topic, payload, len);
+        for (int g = trie[c].child; g >= 0; g = trie[g].next) {
+          if (trie[g].level == "#") call(g, topic, payload, len);
+        }
+      }
+    }
+  }
+}
+
+void MqttService::call(int node, const char *topic, const uint8_t *payload, size_t len) {
+  for (uint8_t i : trie[node].callbacks) {
+    callbackList[i](topic, payload, len);
+    stats.dispatched++;
+  }
+}
@@ -0,0 +1,114 @@
+//=======================================================================
+// EspMqtt.h Arduino EspSetup library ESP8266 / ESP32
+// Non-blocking MQTT 3.1.1 client driven by EspSetup::Loop()
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+#pragma once
+
+#include <WiFiClient.h>
+#include <functional>
+#include <vector>
+
+#define MQTT_QUEUE_SIZE 2048          // outbound packets incl. QoS 1 messages waiting for PUBACK
+#define MQTT_PACKET_MAX 512           // largest inbound packet, larger ones are skipped
+#define MQTT_BATCH_SIZE 536           // queued packets are coalesced into writes of this size
+#define MQTT_KEEPALIVE 30             // seconds
+#define MQTT_CONNECT_TIMEOUT 250      // ms a TCP connect may block (unreachable broker)
+#define MQTT_REPLY_TIMEOUT 5000       // ms to wait for CONNACK or PINGRESP
+#define MQTT_BACKOFF_MIN 1000         // ms before the first reconnect, doubled per failure
+#define MQTT_BACKOFF_MAX 60000
+
+typedef std::function<void(const char *topic, const uint8_t *payload, size_t len)> MqttCallbackFn;
+
+class MqttService
+{
+public:
+  struct Stats {
+    uint32_t published;     // messages queued
+    uint32_t sent;          // PUBLISH packets written (incl. resends)
+    uint32_t acked;         // QoS 1 messages confirmed
+    uint32_t dropped;       // Publish() calls refused, queue full
+    uint32_t received;      // PUBLISH packets received
+    uint32_t dispatched;    // callback calls
+    uint32_t connects;      // successful connects
+    uint32_t failures;      // failed connects and lost connections
+  };
+
+  MqttService() = default;
+  virtual ~MqttService();
+
+  bool Begin(const String &host, uint16_t port, const String &user = "", const String &pass = "", const String &clientId = "");
+  void End();
+  void Loop();                                    // called by EspSetup::Loop(), never blocks longer than MQTT_CONNECT_TIMEOUT
+
+  bool Connected() const { return state == S_CONNECTED; }
+  bool Publish(const char *topic, const uint8_t *payload, size_t len, uint8_t qos = 0, bool retain = false);
+  bool Publish(const char *topic, const String &payload, uint8_t qos = 0, bool retain = false) {
+    return Publish(topic, (const uint8_t*) payload.c_str(), payload.length(), qos, retain);
+  }
+  bool Subscribe(const char *filter, MqttCallbackFn pFunction, uint8_t qos = 0);   // + and # wildcards, kept over reconnects, QoS 2 is subscribed as 1
+  const Stats& GetStats() const { return stats; }
+
+private:
+  enum State { S_IDLE, S_BACKOFF, S_CONNACK, S_CONNECTED };
+  enum Flags { F_QOS1 = 1, F_SENT = 2, F_ACKED = 4 };
+
+  // topic filter trie, one node per level
+  struct Node {
+    String  level;
+    int16_t child = -1;
+    int16_t next = -1;
+    std::vector<uint8_t> callbacks;              // indexes into callbackList (up to 255)
+  };
+
+  bool connect();
+  void disconnect();
+  void fail();
+  uint8_t* reserve(uint8_t header, size_t len, uint8_t flags, uint16_t id);
+  bool subscribe(size_t index);
+  void requeue();
+  void send();
+  void release();
+  size_t entrySize(size_t q) const;
+  bool done(size_t q) const;
+  void receive();
+  void handle(uint8_t header, uint8_t *pData, size_t len);
+  void dispatch(const char *topic, const uint8_t *payload, size_t len);
+  void match(int node, const char *level, const char *topic, const uint8_t *payload, size_t len);
+  void call(int node, const char *topic, const uint8_t *payload, size_t len);
+  int  addNode(int parent, const String &level);
+
+  WiFiClient client;
+  IPAddress  ip;
+  uint16_t   port = 0;
+  String     user;
+  String     pass;
+  String     clientId;
+
+  State    state = S_IDLE;
+  uint32_t timer = 0;                            // state change or last ping
+  uint32_t backoff = MQTT_BACKOFF_MIN;
+  uint32_t lastSend = 0;
+  bool     pingPending = false;
+  uint16_t nextId = 1;
+
+  uint8_t *pQueue = nullptr;                     // entries: len u16, flags u8, id u16, packet
+  size_t   qHead = 0;
+  size_t   qTail = 0;
+  size_t   qSend = 0;                            // next entry to write
+
+  uint8_t *pRx = nullptr;                        // MQTT_PACKET_MAX
+  uint8_t *pBatch = nullptr;                     // MQTT_BATCH_SIZE, coalesced output
+  size_t   rxLen = 0;
+  size_t   rxNeed = 0;                           // whole packet size once the header is complete
+  size_t   rxSkip = 0;                           // bytes left of an oversized packet
+
+  std::vector<Node> trie;
+  std::vector<MqttCallbackFn> callbackList;
+  std::vector<String> filterList;                // resubscribed after a reconnect
+  std::vector<uint8_t> qosList;
+
+  Stats stats = {};
+};
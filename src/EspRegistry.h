@@ -0,0 +1,332 @@
+//=======================================================================
+// EspRegistry.h Arduino EspSetup library ESP8266 / ESP32
+// Device registry with hash indexes on Uuid and Name and a journal file
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+#pragma once
+
+#include "EspSetup.h"
+
+extern EspSetup *pEspSetup;
+
+#define REGISTRY_DOC_SIZE 512       // JSON document per device record
+#define REGISTRY_COMPACT_SLACK 16   // journal lines beyond twice the device count before it is rewritten
+
+// Base of the records stored in a DeviceRegistry. Derived classes add their own
+// members and store them by overriding Save()/Load(). Uuid and Name are indexed,
+// change them by DeviceRegistry::Rename() only.
+class RegistryDevice
+{
+public:
+  RegistryDevice() = default;
+  virtual ~RegistryDevice() = default;
+
+  virtual void Save(JsonObject obj) const {}
+  virtual void Load(JsonObjectConst obj) {}
+
+  String Uuid;
+  String Name;
+};
+
+/*
+   Fixed capacity pool of N (up to 32767) T derived from RegistryDevice. Records never move, so
+   pointers stay valid until the record is removed. Lookups by Uuid or Name hash
+   into open addressed tables (linear probing), no String is compared unless the
+   32 bit hashes match.
+
+   Every change appends one JSON line to the journal file; loading replays it.
+   When the journal holds much more lines than devices it is rewritten (atomic,
+   see EspSetup::CommitFile()).
+*/
+template <class T, size_t N>
+class DeviceRegistry
+{
+  static_assert(N > 0 && N <= 32767, "DeviceRegistry: pool indexes are stored as int16_t");
+
+public:
+  DeviceRegistry(const char *pPath) : path(pPath) {
+    pool = new T[cap];
+    used = new bool[cap]();
+    slots = 16;
+    while (slots < 2 * cap) slots <<= 1;
+    uuidIndex = new int16_t[slots];
+    nameIndex = new int16_t[slots];
+    uuidHash = new uint32_t[cap];
+    nameHash = new uint32_t[cap];
+    clear();
+  }
+  virtual ~DeviceRegistry() {
+    delete[] pool; delete[] used;
+    delete[] uuidIndex; delete[] nameIndex;
+    delete[] uuidHash; delete[] nameHash;
+  }
+
+  bool Load();                                      // replay the journal, false if there is none
+  bool Compact();                                   // rewrite the journal with the current records
+
+  T*   Add(const String &uuid, const String &name); // nullptr if full or the Uuid exists
+  bool Update(const T *pDevice) { return append(pDevice, false); }   // persist changed members
+  bool Rename(T *pDevice, const String &name);
+  bool Remove(T *pDevice);
+
+  T*   FindUuid(const String &uuid) const { int i = find(uuidIndex, hash(uuid), uuid, true); return (i < 0) ? nullptr : &pool[i]; }
+  T*   FindName(const String &name) const { int i = find(nameIndex, hash(name), name, false); return (i < 0) ? nullptr : &pool[i]; }
+
+  size_t Count() const { return count; }
+  size_t Capacity() const { return cap; }
+
+  template <typename F> void ForEach(F fn) {        // fn(T &device) for all records, no copies
+    for (size_t i = 0; i < cap; i++) {
+      if (used[i]) fn(pool[i]);
+    }
+  }
+
+private:
+  static uint32_t hash(const String &key) {         // FNV-1a
+    uint32_t h = 2166136261u;
+    for (const char *p = key.c_str(); *p; p++) {
+      h = (h ^ (uint8_t) *p) * 16777619u;
+    }
+    return h;
+  }
+
+  void clear();
+  int  allocate();
+  int  find(const int16_t *pTable, uint32_t h, const String &key, bool byUuid) const;
+  void insert(int16_t *pTable, uint32_t h, int index);
+  void erase(int16_t *pTable, const uint32_t *pHash, int index);
+  bool append(const T *pDevice, bool removed);
+  bool apply(JsonObjectConst obj);
+
+  T        *pool;
+  bool     *used;
+  static constexpr size_t cap = N;
+  size_t    count = 0;
+  size_t    slots;
+  int16_t  *uuidIndex;              // slot -> pool index, -1 free
+  int16_t  *nameIndex;
+  uint32_t *uuidHash;               // pool index -> hash, avoids rehashing on erase
+  uint32_t *nameHash;
+  size_t    journalLines = 0;
+  bool      loading = false;
+  String    path;
+};
+
+template <class T, size_t N>
+void DeviceRegistry<T, N>::clear() {
+  for (size_t i = 0; i < slots; i++) {
+    uuidIndex[i] = nameIndex[i] = -1;
+  }
+  for (size_t i = 0; i < cap; i++) {
+    used[i] = false;
+  }
+  count = 0;
+}
+
+template <class T, size_t N>
+int DeviceRegistry<T, N>::allocate() {
+  for (size_t i = 0; i < cap; i++) {
+    if (!used[i]) {
+      pool[i] = T();
+      used[i] = true;
+      count++;
+      return i;
+    }
+  }
+  return -1;
+}
+
+template <class T, size_t N>
+int DeviceRegistry<T, N>::find(const int16_t *pTable, uint32_t h, const String &key, bool byUuid) const {
+  const uint32_t *pHash = byUuid ? uuidHash : nameHash;
+  for (size_t s = h & (slots - 1); pTable[s] >= 0; s = (s + 1) & (slots - 1)) {
+    int i = pTable[s];
+    if (pHash[i] == h && (byUuid ? pool[i].Uuid : pool[i].Name) == key) return i;
+  }
+  return -1;
+}
+
+template <class T, size_t N>
+void DeviceRegistry<T, N>::insert(int16_t *pTable, uint32_t h, int index) {
+  size_t s = h & (slots - 1);
+  while (pTable[s] >= 0) s = (s + 1) & (slots - 1);
+  pTable[s] = index;
+}
+
+/*
+   Backward shift deletion keeps the probe sequences intact without tombstones
+*/
+template <class T, size_t N>
+void DeviceRegistry<T, N>::erase(int16_t *pTable, const uint32_t *pHash, int index) {
+  size_t mask = slots - 1;
+  size_t s = pHash[index] & mask;
+  while (pTable[s] != index) s = (s + 1) & mask;
+  pTable[s] = -1;
+  for (size_t j = (s + 1) & mask; pTable[j] >= 0; j = (j + 1) & mask) {
+    size_t home = pHash[pTable[j]] & mask;
+    // move the entry into the hole if its home slot is not between the hole and j
+    if (((j - home) & mask) >= ((j - s) & mask)) {
+      pTable[s] = pTable[j];
+      pTable[j] = -1;
+      s = j;
+    }
+  }
+}
+
+template <class T, size_t N>
+T* DeviceRegistry<T, N>::Add(const String &uuid, const String &name) {
+  if (uuid.isEmpty() || FindUuid(uuid)) return nullptr;
+  int i = allocate();
+  if (i < 0) return nullptr;
+  pool[i].Uuid = uuid;
+  pool[i].Name = name;
+  uuidHash[i] = hash(uuid);
+  nameHash[i] = hash(name);
+  insert(uuidIndex, uuidHash[i], i);
+  insert(nameIndex, nameHash[i], i);
+  append(&pool[i], false);
+  return &pool[i];
+}
+
+template <class T, size_t N>
+bool DeviceRegistry<T, N>::Rename(T *pDevice, const String &name) {
+  int i = pDevice - pool;
+  if (i < 0 || (size_t) i >= cap || !used[i]) return false;
+  erase(nameIndex, nameHash, i);
+  pDevice->Name = name;
+  nameHash[i] = hash(name);
+  insert(nameIndex, nameHash[i], i);
+  return append(pDevice, false);
+}
+
+template <class T, size_t N>
+bool DeviceRegistry<T, N>::Remove(T *pDevice) {
+  int i = pDevice - pool;
+  if (i < 0 || (size_t) i >= cap || !used[i]) return false;
+  erase(uuidIndex, uuidHash, i);
+  erase(nameIndex, nameHash, i);
+  used[i] = false;
+  count--;
+  bool ret = append(pDevice, true);                 // after the removal, a Compact() must not save it
+  pool[i] = T();                                    // release the Strings
+  return ret;
+}
+
+/*
+   Journal line: {"Uuid":..,"Name":..,<Save() members>} or {"Uuid":..,"del":1}
+*/
+template <class T, size_t N>
+bool DeviceRegistry<T, N>::append(const T *pDevice, bool removed) {
+  if (loading) return true;
+  File file = pEspSetup->GetFS()->open(path, "a");
+  if (!file) return false;
+  StaticJsonDocument<REGISTRY_DOC_SIZE> doc;
+  JsonObject obj = doc.to<JsonObject>();
+  obj["Uuid"] = pDevice->Uuid;
+  if (removed) {
+    obj["del"] = 1;
+  } else {
+    obj["Name"] = pDevice->Name;
+    pDevice->Save(obj);
+  }
+  bool ret = serializeJson(doc, file) > 0 && file.print('\n') == 1;
+  file.close();
+  journalLines++;
+  if (journalLines > 2 * count + REGISTRY_COMPACT_SLACK) {
+    ret = Compact() && ret;
+  }
+  return ret;
+}
+
+template <class T, size_t N>
+bool DeviceRegistry<T, N>::apply(JsonObjectConst obj) {
+  String uuid = obj["Uuid"].as<String>();
+  T *pDevice = FindUuid(uuid);
+  if (obj["del"]) {
+    return pDevice && Remove(pDevice);
+  }
+  String name = obj["Name"].as<String>();
+  if (!pDevice) {
+    pDevice = Add(uuid, name);
+  } else if (pDevice->Name != name) {
+    Rename(pDevice, name);
+  }
+  if (pDevice) pDevice->Load(obj);
+  return pDevice != nullptr;
+}
+
+template <class T, size_t N>
+bool DeviceRegistry<T, N>::Load() {
+  FS *fs = pEspSetup->GetFS();
+  String file = path;
+  if (!fs->exists(file)) {
+    file += FILE_BAK_EXT;                           // interrupted Compact()
+    if (!fs->exists(file)) return false;
+  }
+  File f = fs->open(file, "r");
+  if (!f) return false;
+  size_t size = f.size();
+  bool torn = size > 0 && f.seek(size - 1) && f.read() != '\n';
+  f.seek(0);
+  clear();
+  journalLines = 0;
+  loading = true;
+  StaticJsonDocument<REGISTRY_DOC_SIZE> doc;
+  char line[REGISTRY_DOC_SIZE];
+  while (f.available()) {
+    // a line torn by a power loss fails to parse and is skipped, the next line is
+    // parsed on its own. A line that does not fit the buffer is skipped as well.
+    size_t len = f.readBytesUntil('\n', line, sizeof(line) - 1);
+    bool fits = len < sizeof(line) - 1 || f.peek() == '\n' || f.peek() < 0;
+    if (len == sizeof(line) - 1) {
+      while (f.available() && f.read() != '\n');  // rest of the line, or its terminator
+    }
+    if (fits && !deserializeJson(doc, (const char*) line, len) && doc.is<JsonObject>()) {
+      apply(doc.as<JsonObjectConst>());
+    }
+    journalLines++;
+  }
+  f.close();
+  loading = false;
+  if (file != path) {
+    // put the journal back before anything is appended, a new one would hold the
+    // appended lines only and hide the .bak on the next Load()
+    Compact();
+  } else if (torn) {
+    // terminate the torn line, otherwise the next append() would be glued onto it
+    File journal = fs->open(path, "a");
+    if (journal) {
+      journal.print('\n');
+      journal.close();
+    }
+  }
+  return true;
+}
+
+template <class T, size_t N>
+bool DeviceRegistry<T, N>::Compact() {
+  FS *fs = pEspSetup->GetFS();
+  File file = fs->open(path + FILE_TMP_EXT, "w");
+  if (!file) return false;
+  bool ret = true;
+  StaticJsonDocument<REGISTRY_DOC_SIZE> doc;
+  for (size_t i = 0; i < cap && ret; i++) {
+    if (!used[i]) continue;
+    doc.clear();
+    JsonObject obj = doc.to<JsonObject>();
+    obj["Uuid"] = pool[i].Uuid;
+    obj["Name"] = pool[i].Name;
+    pool[i].Save(obj);
+    ret = serializeJson(doc, file) > 0 && file.print('\n') == 1;
+  }
+  file.flush();
+  file.close();
+  if (!ret) {
+    fs->remove(path + FILE_TMP_EXT);
+    return false;
+  }
+  journalLines = count;
+  return EspSetup::CommitFile(path, true);         // Load() falls back to the .bak
+}
@@ -0,0 +1,93 @@
+//=======================================================================
+// EspScan.cpp Arduino EspSetup library ESP8266 / ESP32
+// Background WiFi scan with a result cache, driven by EspSetup::Loop()
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+
+#include <ESP8266WiFi.h>
+#include "EspScan.h"
+
+extern Stream *pEspConsole;
+
+/*
+   The core scans asynchronously, WiFi.scanComplete() tells when the results are there.
+   In AP mode the station interface is switched on for the scan, the AP keeps running.
+*/
+bool WifiScan::Start(ScanDoneFn pDoneFn)
+{
+  if (pDoneFn) doneList.push_back(pDoneFn);
+  if (running) return false;
+  running = WiFi.scanNetworks(true, false) == WIFI_SCAN_RUNNING;
+  if (!running) {
+    Loop();                                   // failed to start, tell the waiting callers
+  }
+  return running;
+}
+
+void WifiScan::Loop()
+{
+  if (!running && doneList.empty()) return;
+  int n = WiFi.scanComplete();
+  if (n == WIFI_SCAN_RUNNING) return;
+  running = false;
+  if (n >= 0) {
+    count = 0;
+    for (int i = 0; i < n; i++) {
+      // insert sorted by RSSI, the weakest fall off the end
+      int8_t rssi = WiFi.RSSI(i);
+      int pos = count;
+      while (pos > 0 && results[pos - 1].rssi < rssi) pos--;
+      if (pos >= SCAN_MAX_RESULTS) continue;
+      int last = (count < SCAN_MAX_RESULTS) ? count++ : SCAN_MAX_RESULTS - 1;
+      memmove(&results[pos + 1], &results[pos], (last - pos) * sizeof(ScanResult));
+      ScanResult &r = results[pos];
+      strlcpy(r.ssid, WiFi.SSID(i).c_str(), sizeof(r.ssid));
+      memcpy(r.bssid, WiFi.BSSID(i), sizeof(r.bssid));
+      r.rssi = rssi;
+      r.channel = WiFi.channel(i);
+      r.encryption = WiFi.encryptionType(i);
+    }
+    scanMillis = millis() | 1;                // 0 means no scan yet
+    WiFi.scanDelete();
+    pEspConsole->printf("WiFi scan: %d networks\n", n);
+  }
+  std::vector<ScanDoneFn> list;
+  list.swap(doneList);                        // a callback may start the next scan
+  for (ScanDoneFn fn : list) {
+    fn(n >= 0);
+  }
+}
+
+const ScanResult* WifiScan::Best(const String &ssid, uint32_t maxAge) const
+{
+  if (Age() > maxAge) return nullptr;
+  for (int i = 0; i < count; i++) {
+    if (ssid == results[i].ssid) return &results[i];    // sorted, the first is the strongest
+  }
+  return nullptr;
+}
+
+String WifiScan::ToJson() const
+{
+  String json;
+  json.reserve(32 + count * 96);
+  json = F("{\"scan\":{\"age\":");
+  json += Valid() ? Age() : 0;
+  json += F(",\"nets\":[");
+  for (int i = 0; i < count; i++) {
+    const ScanResult &r = results[i];
+    json += (i == 0) ? F("{\"ssid\":\"") : F(",{\"ssid\":\"");
+    for (const char *p = r.ssid; *p; p++) {
+      if (*p == '"' || *p == '\\') json += '\\';
+      if ((uint8_t) *p >= ' ') json += *p;      // control characters are dropped
+    }
+    char buf[80];
+    snprintf(buf, sizeof(buf), "\",\"bssid\":\"%02X:%02X:%02X:%02X:%02X:%02X\",\"rssi\":%d,\"ch\":%u,\"enc\":%u}",
+             r.bssid[0], r.bssid[1], r.bssid[2], r.bssid[3], r.bssid[4], r.bssid[5], r.rssi, r.channel, r.encryption);
+    json += buf;
+  }
+  json += F("]}}");
+  return json;
+}
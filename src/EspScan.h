@@ -0,0 +1,50 @@
+//=======================================================================
+// EspScan.h Arduino EspSetup library ESP8266 / ESP32
+// Background WiFi scan with a result cache, driven by EspSetup::Loop()
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <vector>
+
+#define SCAN_MAX_RESULTS 16           // strongest networks kept of a scan
+#define SCAN_MAX_AGE 30000            // ms a cached scan is answered without scanning again
+
+struct ScanResult
+{
+  char    ssid[33];
+  uint8_t bssid[6];
+  int8_t  rssi;                       // dBm
+  uint8_t channel;
+  uint8_t encryption;                 // ENC_TYPE_xxx of the core
+};
+
+typedef std::function<void(bool ok)> ScanDoneFn;
+
+class WifiScan
+{
+public:
+  WifiScan() = default;
+
+  bool Start(ScanDoneFn pDoneFn = nullptr);  // false if a scan is running already, pDoneFn is called anyway
+  void Loop();                               // called by EspSetup::Loop(), picks up the finished scan
+
+  bool Running() const { return running; }
+  bool Valid() const { return scanMillis != 0; }
+  uint32_t Age() const { return Valid() ? millis() - scanMillis : UINT32_MAX; }   // ms since the last scan finished
+  int  Count() const { return count; }
+  const ScanResult& Result(int i) const { return results[i]; }   // sorted by RSSI, strongest first
+  const ScanResult* Best(const String &ssid, uint32_t maxAge = SCAN_MAX_AGE) const;   // nullptr if not seen recently
+  String ToJson() const;                     // {"scan":{"age":ms,"nets":[{"ssid":..,"bssid":..,"rssi":..,"ch":..,"enc":..},..]}}
+
+private:
+  ScanResult results[SCAN_MAX_RESULTS];
+  int        count = 0;
+  uint32_t   scanMillis = 0;
+  bool       running = false;
+  std::vector<ScanDoneFn> doneList;
+};
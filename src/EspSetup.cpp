@@ -12,7 +12,23 @@
 #include <ESP8266mDNS.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
+#include <Updater.h>
+#include <bearssl/bearssl_hash.h>
+#include <bearssl/bearssl_hmac.h>
+#include <flash_hal.h>
+#include <algorithm>
+#include <climits>
+#include <limits>
 #include "EspSetup.h"
+#include "EspDelta.h"
+
+// build with -DESPSETUP_ASSETS and a generated EspAssets.h (tools/mkassets.py)
+// to serve the core UI from flash
+#if defined(ESPSETUP_ASSETS) && __has_include("EspAssets.h")
+#include "EspAssets.h"
+#else
+#define ESP_ASSET_COUNT 0
+#endif
 
 //#define DEBUG_VERBOSE
 #define FileSystemName "LittleFS"
@@ -26,8 +42,9 @@ NTPClient  ntp;
 
 //== used for statics and global functions ===
 
-EspSetup *pEspSetup;
-Stream   *pEspConsole;
+EspSetup   *pEspSetup;
+Stream     *pEspConsole;
+ConsoleLog *pEspLog;
 
 //=== Telnet Server ===
 
@@ -40,20 +57,86 @@ void OnTcpReceive(char* txt) {
 WebSocketsServer EspWebSocket = WebSocketsServer(81);
 
 int webSocketsConnected = 0;
+uint32_t webSocketLogMask = 0;                              // clients subscribed by "EspSetupLog"
+uint32_t webSocketLogPos[WEBSOCKETS_SERVER_CLIENT_MAX];     // next log position to send per client
+
+uint32_t webSocketAuthMask = 0;                             // clients that passed the session check
+uint32_t webSocketBinaryMask = 0;                           // clients that take MessagePack, "EspSetupMsgPack"
+char webSocketCookie[64];                                   // session cookie of the handshake in progress
+
+/*
+   Called for the headers of a WebSocket handshake, remembers the session cookie
+   for the check in EspWebSocketCallback(). The library has no handshake start event,
+   Host comes once per request and first from browsers, so it drops the cookie of an
+   earlier handshake that failed before the check. A client sending Host after its
+   cookie is refused, never let in with another client's cookie.
+*/
+bool EspWebSocketHeader(String name, String value)
+{
+  if (name.equalsIgnoreCase("Host")) {
+    webSocketCookie[0] = 0;
+  } else if (name.equalsIgnoreCase("Cookie")) {
+    int pos = value.indexOf("EspSession=");
+    strlcpy(webSocketCookie, (pos < 0) ? "" : value.c_str() + pos, sizeof(webSocketCookie));
+  }
+  return true;
+}
 
 void EspWebSocketCallback(uint8_t num, WStype_t type, uint8_t *payload, size_t len)
 {
+  // with webUser/webPass configured a client needs the session cookie of a web login
+  if (type == WStype_CONNECTED) {
+    bool ok = pEspSetup->CheckSessionCookie(webSocketCookie, EspWebSocket.remoteIP(num));
+    webSocketCookie[0] = 0;
+    if (!ok) {
+      pEspConsole->printf("[%u] Not logged in ... disconnect\n", num);
+      EspWebSocket.disconnect(num);
+      return;
+    }
+    webSocketAuthMask |= 1u << num;
+  }
+  if (!(webSocketAuthMask & (1u << num))) {
+    return;
+  }
+  if (type == WStype_DISCONNECTED) {
+    webSocketAuthMask &= ~(1u << num);
+  }
   for (WebSocketServerEvent WsCbFn : pEspSetup->GetWebSocketCallbackList()) {
     WsCbFn(num, type, payload, len);
   }
 }
 
+/*
+   "EspSetupScan" answers the cached networks if they are recent, otherwise a background
+   scan is started and all clients that asked meanwhile get its result
+*/
+void EspWebSocketScan(uint8_t num)
+{
+  WifiScan &scan = pEspSetup->Scan();
+  if (scan.Valid() && scan.Age() < SCAN_MAX_AGE && !scan.Running()) {
+    String json = scan.ToJson();
+    EspWebSocket.sendTXT(num, json);
+    return;
+  }
+  scan.Start([num](bool ok) {
+    if (EspWebSocket.clientIsConnected(num)) {
+      String json = pEspSetup->Scan().ToJson();
+      EspWebSocket.sendTXT(num, json);
+    }
+  });
+}
+
 void EspWebSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t len)
 {
+  if (pEspSetup->WebSocketOta(num, type, payload, len)) {
+    return;
+  }
   switch(type) {
     case WStype_DISCONNECTED:
       pEspConsole->printf("[%u] Disconnected!\n", num);
       webSocketsConnected -= 1;
+      webSocketLogMask &= ~(1u << num);
+      webSocketBinaryMask &= ~(1u << num);
       break;
     case WStype_CONNECTED: {
       IPAddress ip = EspWebSocket.remoteIP(num);
@@ -62,10 +145,17 @@ void EspWebSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t len)
       break;
     }
     case WStype_TEXT:
-      if (len > 12) {
-        if (!strncmp((const char*) payload, "EspSetupPage", 12)) { EspWebSocket.sendTXT(num, pEspSetup->DumpNetworkConfiguration().c_str()); }
+      if (len >= 11) {
+        if (!strncmp((const char*) payload, "EspSetupPage", 12)) {
+          StaticJsonDocument<768> doc;
+          pEspSetup->DumpNetworkConfiguration(doc);
+          pEspSetup->WebSocketSendJson(num, doc);
+        }
+        else if (!strncmp((const char*) payload, "EspSetupMsgPack", 15)) { webSocketBinaryMask |= 1u << num; }
         else if (!strncmp((const char*) payload, "EspSetupSave", 12)) { pEspSetup->SaveNetworkConfiguration((char*)&payload[12]); }
         else if (!strncmp((const char*) payload, "EspSetupReset", 13)) { ESP.reset(); }
+        else if (!strncmp((const char*) payload, "EspSetupScan", 12)) { EspWebSocketScan(num); }
+        else if (!strncmp((const char*) payload, "EspSetupLog", 11)) { webSocketLogMask |= 1u << num; webSocketLogPos[num] = pEspLog->Tail(); }
       }
       break;
     default:
@@ -77,11 +167,16 @@ void EspWebSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t len)
 
 static bool fsOK;
 String unsupportedFiles = String();
+// statistics of the last finished upload, reported by /status
+size_t lastUploadSize = 0;
+unsigned long lastUploadMillis = 0;
 
 static const char TEXT_PLAIN[] PROGMEM = "text/plain";
 static const char FS_INIT_ERROR[] PROGMEM = "FS INIT ERROR";
 static const char FILE_NOT_FOUND[] PROGMEM = "FileNotFound";
 
+static const char *requestHeaders[] = { "Range", "Cookie", "X-OTA-Password" };
+
 ////////////////////////////////
 // Utils to return HTTP codes, and determine content-type
 
@@ -102,11 +197,238 @@ void replyBadRequest(String msg) {
   pEspSetup->send(400, FPSTR(TEXT_PLAIN), msg + "\r\n");
 }
 
+void replyRedirectSetup() {
+  pEspSetup->sendHeader("Location", String("http://") + WiFi.softAPIP().toString() + "/setup", true);
+  pEspSetup->send(302, FPSTR(TEXT_PLAIN), "");
+}
+
 void replyServerError(String msg) {
   pEspConsole->println(msg);
   pEspSetup->send(500, FPSTR(TEXT_PLAIN), msg + "\r\n");
 }
 
+////////////////////////////////
+// Session cookie and login throttling
+
+#define SESSION_COOKIE "EspSession="
+#define SESSION_TOKEN_LEN 40    // 8 hex digits expiry (millis), 32 hex digits truncated HMAC-SHA256
+
+struct AuthFailure
+{
+  IPAddress ip;
+  uint8_t   count;
+  uint32_t  lastMillis;
+};
+
+static uint8_t sessionKey[32];          // random per boot, a reboot ends all sessions
+static bool sessionKeyValid = false;
+static bool sessionIssued = false;      // the current response carries a Set-Cookie header
+static AuthFailure authFailures[AUTH_FAIL_SLOTS];
+
+/*
+   HMAC over expiry and client IP, written as 32 hex digits and a terminating zero
+*/
+static void sessionMac(uint32_t expiry, const IPAddress &ip, char *pHex) {
+  if (!sessionKeyValid) {
+    for (size_t i = 0; i < sizeof(sessionKey); i += 4) {
+      uint32_t r = ESP.random();
+      memcpy(&sessionKey[i], &r, 4);
+    }
+    sessionKeyValid = true;
+  }
+  uint8_t msg[8] = { (uint8_t) (expiry >> 24), (uint8_t) (expiry >> 16), (uint8_t) (expiry >> 8), (uint8_t) expiry,
+                     ip[0], ip[1], ip[2], ip[3] };
+  uint8_t mac[16];
+  br_hmac_key_context kc;
+  br_hmac_context hc;
+  br_hmac_key_init(&kc, &br_sha256_vtable, sessionKey, sizeof(sessionKey));
+  br_hmac_init(&hc, &kc, sizeof(mac));
+  br_hmac_update(&hc, msg, sizeof(msg));
+  br_hmac_out(&hc, mac);
+  for (size_t i = 0; i < sizeof(mac); i++) {
+    sprintf(&pHex[2 * i], "%02x", mac[i]);
+  }
+}
+
+static int hexValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+/*
+   Failure record of a client IP, a new one replaces a free or the oldest record
+*/
+static AuthFailure* authFailure(const IPAddress &ip, bool create) {
+  AuthFailure *pSlot = &authFailures[0];
+  for (AuthFailure &failure : authFailures) {
+    if (failure.count && failure.ip == ip) return &failure;
+    if (pSlot->count && (!failure.count || millis() - failure.lastMillis > millis() - pSlot->lastMillis)) pSlot = &failure;
+  }
+  if (!create) return nullptr;
+  pSlot->ip = ip;
+  pSlot->count = 0;
+  pSlot->lastMillis = millis();
+  return pSlot;
+}
+
+////////////////////////////////
+// Background file responses
+
+#ifdef ESPSETUP_ASYNC
+/*
+   With -DESPSETUP_ASYNC file responses are not pushed by the handler. The response
+   header is written at once, the client connection is handed over to a stream slot
+   and the content is sent from Loop() as the TCP window allows. handleClient() is
+   free for the next request meanwhile, so a large edit.htm does not hold up other
+   clients or the WebSocket loop. The connection is closed after the response.
+   If all slots are busy the response is sent the blocking way.
+*/
+struct HttpStream
+{
+  WiFiClient     client;
+  File           file;
+  const uint8_t *pFlash = nullptr;    // PROGMEM asset instead of a file
+  size_t         remain = 0;
+  unsigned long  lastMillis = 0;
+  bool           active = false;
+};
+
+static HttpStream httpStreams[HTTP_STREAM_SLOTS];
+
+static bool httpStreamBegin(int code, const String &contentType, const String &headers, File *pFile, const uint8_t *pFlash, size_t start, size_t len) {
+  HttpStream *pStream = nullptr;
+  for (HttpStream &stream : httpStreams) {
+    if (!stream.active) {
+      pStream = &stream;
+      break;
+    }
+  }
+  // a header set by sendHeader(), e.g. the session cookie, only goes out with the blocking response
+  if (!pStream || sessionIssued || (pFile && !pFile->seek(start))) {
+    return false;
+  }
+  String head;
+  head.reserve(160 + headers.length());
+  head = F("HTTP/1.1 ");
+  head += code;
+  head += (code == 206) ? F(" Partial Content") : F(" OK");
+  head += F("\r\nContent-Type: ");
+  head += contentType;
+  head += F("\r\nContent-Length: ");
+  head += len;
+  head += headers;
+  head += F("\r\nConnection: close\r\n\r\n");
+  WiFiClient &client = pEspSetup->client();
+  client.write((const uint8_t*) head.c_str(), head.length());
+
+  pStream->client = client;               // keeps the connection open when the server lets go of it
+  pEspSetup->KeepAliveRelease();
+  if (pFile) pStream->file = *pFile;
+  pStream->pFlash = pFlash ? pFlash + start : nullptr;
+  pStream->remain = (pEspSetup->method() == HTTP_HEAD) ? 0 : len;
+  pStream->lastMillis = millis();
+  pStream->active = true;
+  return true;
+}
+
+static void httpStreamEnd(HttpStream &rStream) {
+  if (rStream.remain > 0) {
+    pEspConsole->println("Sent less data than expected!");
+  }
+  if (rStream.file) rStream.file.close();
+  rStream.client.stop();
+  rStream.client = WiFiClient();
+  rStream.file = File();
+  rStream.active = false;
+}
+
+void httpStreamLoop() {
+  for (HttpStream &stream : httpStreams) {
+    if (!stream.active) continue;
+    if (stream.remain == 0 || !stream.client.connected() || millis() - stream.lastMillis > HTTP_STREAM_TIMEOUT) {
+      httpStreamEnd(stream);
+      continue;
+    }
+    int room = stream.client.availableForWrite();
+    if (room <= 0) continue;
+    char *pBuf = ChunkWriter::AcquireBuffer();
+    char stackBuf[FILE_READ_CHUNK_SIZE];
+    size_t n = std::min(stream.remain, std::min((size_t) room, pBuf ? (size_t) RESPONSE_BUFFER_SIZE : sizeof(stackBuf)));
+    char *buf = pBuf ? pBuf : stackBuf;
+    if (stream.pFlash) {
+      memcpy_P(buf, stream.pFlash, n);
+      stream.pFlash += n;
+    } else {
+      n = stream.file.read((uint8_t*) buf, n);
+    }
+    size_t sent = n ? stream.client.write((const uint8_t*) buf, n) : 0;
+    ChunkWriter::ReleaseBuffer(pBuf);
+    if (sent != n || n == 0) {
+      httpStreamEnd(stream);
+      continue;
+    }
+    stream.remain -= n;
+    stream.lastMillis = millis();
+  }
+}
+#else
+static bool httpStreamBegin(int, const String &, const String &, File *, const uint8_t *, size_t, size_t) { return false; }
+void httpStreamLoop() {}
+#endif
+
+////////////////////////////////
+// Read-only assets linked into flash
+
+#if ESP_ASSET_COUNT > 0
+static bool assetOverride[ESP_ASSET_COUNT];   // a file with the same path exists on LittleFS
+
+/*
+   Binary search in the sorted asset index, returns -1 if not found
+*/
+int findAsset(const String &path) {
+  int lo = 0, hi = ESP_ASSET_COUNT - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    int cmp = strcmp_P(path.c_str(), (PGM_P) pgm_read_ptr(&EspAssets[mid].path));
+    if (cmp == 0) return mid;
+    if (cmp < 0) hi = mid - 1;
+    else lo = mid + 1;
+  }
+  return -1;
+}
+
+/*
+   Files on LittleFS take precedence over assets, remember which ones exist so
+   serving an asset does not need to touch the filesystem.
+   Has to be called whenever files are created, uploaded, renamed or deleted.
+*/
+void refreshAssetOverrides() {
+  for (int i = 0; i < ESP_ASSET_COUNT; i++) {
+    String path = FPSTR((PGM_P) pgm_read_ptr(&EspAssets[i].path));
+    assetOverride[i] = fsOK && (EspFileSytem->exists(path) || EspFileSytem->exists(path + ".gz"));
+  }
+}
+
+bool handleAssetRead(const String &path, const String &contentType) {
+  int i = findAsset(path);
+  if (i < 0 || assetOverride[i]) {
+    return false;
+  }
+  EspAsset asset;
+  memcpy_P(&asset, &EspAssets[i], sizeof(asset));
+  if (httpStreamBegin(200, contentType, F("\r\nContent-Encoding: gzip"), nullptr, asset.data, 0, asset.size)) {
+    return true;
+  }
+  pEspSetup->sendHeader(F("Content-Encoding"), F("gzip"));
+  pEspSetup->send_P(200, contentType.c_str(), (PGM_P) asset.data, asset.size);
+  return true;
+}
+#else
+void refreshAssetOverrides() {}
+bool handleAssetRead(const String &, const String &) { return false; }
+#endif
+
 /*
    Return the FS type, status and size info
 */
@@ -129,6 +451,18 @@ void EspSetup::handleStatus() {
   } else {
     json += "\"false\"";
   }
+  json += F(",\"uploadSize\":");
+  json += lastUploadSize;
+  json += F(",\"uploadMillis\":");
+  json += lastUploadMillis;
+  json += F(",\"udpReceived\":");
+  json += pEspSetup->udpReceived;
+  json += F(",\"udpTruncated\":");
+  json += pEspSetup->udpTruncated;
+  json += F(",\"dnsAnswered\":");
+  json += pEspSetup->dnsAnswered;
+  json += F(",\"dnsDropped\":");
+  json += pEspSetup->dnsDropped;
   json += F(",\"unsupportedFiles\":\"");
   json += unsupportedFiles;
   json += "\"}";
@@ -141,20 +475,21 @@ void EspSetup::handleStatus() {
 */
 bool EspSetup::handleFileRead(String path) {
   pEspConsole->println(String("handleFileRead: ") + path);
-  if (!fsOK) {
-    replyServerError(FPSTR(FS_INIT_ERROR));
-    return true;
-  }
 
   if (path.endsWith("/")) {
     path += "index.htm";
   }
 
-  String contentType;
-  if (pEspSetup->hasArg("download")) {
-    contentType = F("application/octet-stream");
-  } else {
-    contentType = mime::getContentType(path);
+  String contentType = GetContentType(path);
+
+  // assets linked into flash are served even if the filesystem failed
+  if (handleAssetRead(path, contentType)) {
+    return true;
+  }
+
+  if (!fsOK) {
+    replyServerError(FPSTR(FS_INIT_ERROR));
+    return true;
   }
 
   if (!EspFileSytem->exists(path)) {
@@ -163,6 +498,27 @@ bool EspSetup::handleFileRead(String path) {
   }
   if (EspFileSytem->exists(path)) {
     File file = EspFileSytem->open(path, "r");
+    // a range of a gzip file is only useful for raw downloads, the browser can't decode it
+    bool rangeable = !path.endsWith(".gz") || pEspSetup->hasArg("download");
+    if (rangeable && pEspSetup->hasHeader("Range")) {
+      if (streamFileRange(file, contentType)) {
+        if (file) file.close();
+        return true;
+      }
+    }
+    String headers;
+    if (rangeable) {
+      headers = F("\r\nAccept-Ranges: bytes");
+    }
+    if (path.endsWith(".gz") && contentType != F("application/x-gzip") && contentType != F("application/octet-stream")) {
+      headers += F("\r\nContent-Encoding: gzip");
+    }
+    if (httpStreamBegin(200, contentType, headers, &file, nullptr, 0, file.size())) {
+      return true;                          // the stream slot owns the file now
+    }
+    if (rangeable) {
+      pEspSetup->sendHeader(F("Accept-Ranges"), F("bytes"));
+    }
     if (pEspSetup->streamFile(file, contentType) != file.size()) {
       pEspConsole->println("Sent less data than expected!");
     }
@@ -173,6 +529,91 @@ bool EspSetup::handleFileRead(String path) {
   return false;
 }
 
+/*
+   Digits of a Range value, saturates instead of wrapping around. Returns false if
+   there is no digit.
+*/
+static bool parseRangeNumber(const char *&p, size_t &value) {
+  if (!isdigit(*p)) return false;
+  value = 0;
+  for (; isdigit(*p); p++) {
+    size_t digit = *p - '0';
+    value = (value > (SIZE_MAX - digit) / 10) ? SIZE_MAX : value * 10 + digit;
+  }
+  return true;
+}
+
+/*
+   Answer a "Range: bytes=" request with 206 Partial Content.
+   Supported are single ranges "first-last", "first-" and "-suffix". Returns false
+   for anything else (e.g. multiple ranges or first > last), the whole file is sent
+   then. 416 is only sent for a valid range beyond the end of the file.
+*/
+bool EspSetup::streamFileRange(File &file, const String &contentType) {
+  String range = pEspSetup->header("Range");
+  size_t size = file.size();
+  if (!range.startsWith("bytes=")) {
+    return false;
+  }
+  const char *p = range.c_str() + 6;
+  size_t start, end;
+  if (*p == '-') {
+    // suffix range, the last n bytes
+    size_t n;
+    p++;
+    if (!parseRangeNumber(p, n) || *p) {
+      return false;
+    }
+    start = (n == 0) ? size : (n < size) ? size - n : 0;
+    end = size - 1;
+  } else {
+    if (!parseRangeNumber(p, start) || *p++ != '-') {
+      return false;
+    }
+    end = SIZE_MAX;
+    if (*p && (!parseRangeNumber(p, end) || *p || end < start)) {
+      return false;
+    }
+    end = std::min(end, size - 1);
+  }
+
+  if (start >= size || end < start) {
+    pEspSetup->sendHeader(F("Content-Range"), String("bytes */") + size);
+    pEspSetup->send(416, FPSTR(TEXT_PLAIN), "");
+    return true;
+  }
+
+  size_t len = end - start + 1;
+  String headers = F("\r\nAccept-Ranges: bytes\r\nContent-Range: bytes ");
+  headers += String(start) + '-' + end + '/' + size;
+  if (httpStreamBegin(206, contentType, headers, &file, nullptr, start, len)) {
+    file = File();                          // the stream slot owns the file now, keep the caller from closing it
+    return true;
+  }
+  pEspSetup->sendHeader(F("Accept-Ranges"), F("bytes"));
+  pEspSetup->sendHeader(F("Content-Range"), String("bytes ") + start + '-' + end + '/' + size);
+  pEspSetup->setContentLength(len);
+  pEspSetup->send(206, contentType.c_str(), "");
+
+  if (pEspSetup->method() != HTTP_HEAD && file.seek(start)) {
+    char *pBuf = ChunkWriter::AcquireBuffer();
+    char stackBuf[FILE_READ_CHUNK_SIZE];
+    size_t bufSize = pBuf ? RESPONSE_BUFFER_SIZE : sizeof(stackBuf);
+    char *buf = pBuf ? pBuf : stackBuf;
+    WiFiClient &client = pEspSetup->client();
+    while (len > 0 && client.connected()) {
+      size_t n = file.read((uint8_t*) buf, std::min(len, bufSize));
+      if (n == 0 || client.write((const uint8_t*) buf, n) != n) break;
+      len -= n;
+    }
+    ChunkWriter::ReleaseBuffer(pBuf);
+    if (len > 0) {
+      pEspConsole->println("Sent less data than expected!");
+    }
+  }
+  return true;
+}
+
 /*
    As some FS (e.g. LittleFS) delete the parent folder when the last child has been removed,
    return the path of the closest parent still existing
@@ -199,11 +640,16 @@ String lastExistingParent(String path) {
    Move file      | parent of source file, or remaining ancestor
    Rename folder  | parent of source folder
    Move folder    | parent of source folder, or remaining ancestor
+   Move/copy many | progress report, see handleFileBulk()
 */
 void EspSetup::handleFileCreate() {
   if (!fsOK) {
     return replyServerError(FPSTR(FS_INIT_ERROR));
   }
+  if (pEspSetup->hasArg("op")) {
+    const String &op = pEspSetup->arg("op");
+    return handleFileBulk(op == "move" || op == "copy" ? op : "");   // delete is DELETE only
+  }
 
   String path = pEspSetup->arg("path");
   if (path.isEmpty()) {
@@ -237,6 +683,7 @@ void EspSetup::handleFileCreate() {
         return replyServerError(F("CREATE FAILED"));
       }
     }
+    refreshAssetOverrides();
     if (path.lastIndexOf('/') > -1) {
       path = path.substring(0, path.lastIndexOf('/'));
     }
@@ -261,6 +708,7 @@ void EspSetup::handleFileCreate() {
     if (!EspFileSytem->rename(src, path)) {
       return replyServerError(F("RENAME FAILED"));
     }
+    refreshAssetOverrides();
     replyOKWithMsg(lastExistingParent(src));
   }
 }
@@ -268,32 +716,106 @@ void EspSetup::handleFileCreate() {
 /*
    Delete the file or folder designed by the given path.
    If it's a file, delete it.
-   If it's a folder, delete all nested contents first then the folder itself
+   If it's a folder, delete all nested contents first then the folder itself.
 
-   IMPORTANT NOTE: using recursion is generally not recommended on embedded devices and can lead to crashes (stack overflow errors).
-   This use is just for demonstration purpose, and FSBrowser might crash in case of deeply nested filesystems.
-   Please don't do this on a production system.
+   The tree is walked iteratively: descend into the first sub folder found, delete files
+   one by one and go up again when a folder is empty. Only the current path is kept in
+   memory, so the stack and heap usage does not depend on the depth of the tree.
+   Note: LittleFS removes a folder by itself when its last child has been deleted.
 */
-void EspSetup::deleteRecursive(String path) {
+bool EspSetup::deleteRecursive(String path) {
   File file = EspFileSytem->open(path, "r");
   bool isDir = file.isDirectory();
   file.close();
 
   // If it's a plain file, delete it
   if (!isDir) {
-    EspFileSytem->remove(path);
-    return;
+    return EspFileSytem->remove(path);
   }
 
-  // Otherwise delete its contents first
-  Dir dir = EspFileSytem->openDir(path);
+  const size_t rootLen = path.length();
+  while (true) {
+    if (EspFileSytem->exists(path)) {
+      Dir dir = EspFileSytem->openDir(path);
+      if (dir.next()) {
+        String child = path + '/' + dir.fileName();
+        if (dir.isDirectory()) {
+          path = child;                       // descend
+        } else if (!EspFileSytem->remove(child)) {
+          return false;
+        }
+        yield();
+        continue;
+      }
+      // folder is empty, delete the folder itself
+      if (!EspFileSytem->rmdir(path)) {
+        return false;
+      }
+    }
+    if (path.length() <= rootLen) {
+      break;
+    }
+    path.remove(path.lastIndexOf('/'));       // go up one level
+  }
+  return true;
+}
 
-  while (dir.next()) {
-    deleteRecursive(path + '/' + dir.fileName());
+/*
+   Copy a single file in chunks
+*/
+bool copyFile(const String &src, const String &dst) {
+  File in = EspFileSytem->open(src, "r");
+  File out = EspFileSytem->open(dst, "w");
+  bool ret = in && out;
+  uint8_t buf[FILE_COPY_CHUNK_SIZE];
+  while (ret && in.available()) {
+    size_t len = in.read(buf, sizeof(buf));
+    ret = len > 0 && out.write(buf, len) == len;
+  }
+  in.close();
+  out.close();
+  return ret;
+}
+
+/*
+   Copy a file or a folder including all nested contents.
+   Folders still to be copied are kept in an explicit list instead of recursion.
+*/
+bool EspSetup::copyRecursive(String src, String dst) {
+  if (src.endsWith("/")) src.remove(src.length() - 1);
+  if (dst.endsWith("/")) dst.remove(dst.length() - 1);
+  // copying a folder into itself would never end
+  if (dst == src || dst.startsWith(src + '/')) {
+    return false;
+  }
+
+  File file = EspFileSytem->open(src, "r");
+  bool isDir = file.isDirectory();
+  file.close();
+  if (!isDir) {
+    return copyFile(src, dst);
   }
 
-  // Then delete the folder itself
-  EspFileSytem->rmdir(path);
+  std::vector<String> pending;                // sub folders relative to src
+  pending.push_back(String());
+  while (!pending.empty()) {
+    String sub = pending.back();
+    pending.pop_back();
+    if (!EspFileSytem->mkdir(dst + sub) && !EspFileSytem->exists(dst + sub)) {
+      return false;
+    }
+    Dir dir = EspFileSytem->openDir(src + sub);
+    while (dir.next()) {
+      String child = sub + '/' + dir.fileName();
+      if (dir.isDirectory()) {
+        pending.push_back(child);
+      } else if (!copyFile(src + child, dst + child)) {
+        return false;
+      }
+      yield();
+    }
+  }
+  return true;
 }
 
 /*
@@ -302,13 +824,17 @@ void EspSetup::deleteRecursive(String path) {
    ---------------+--------------------------------------------------------------
    Delete file    | parent of deleted file, or remaining ancestor
    Delete folder  | parent of deleted folder, or remaining ancestor
+   Delete many    | progress report, see handleFileBulk()
 */
 void EspSetup::handleFileDelete() {
   if (!fsOK) {
     return replyServerError(FPSTR(FS_INIT_ERROR));
   }
+  if (pEspSetup->hasArg("op")) {
+    return handleFileBulk(pEspSetup->arg("op") == "delete" ? "delete" : "");
+  }
 
-  String path = pEspSetup->arg(0);
+  String path = pEspSetup->arg("path");
   if (path.isEmpty() || path == "/") {
     return replyBadRequest("BAD PATH");
   }
@@ -318,16 +844,131 @@ void EspSetup::handleFileDelete() {
     return replyNotFound(FPSTR(FILE_NOT_FOUND));
   }
   deleteRecursive(path);
+  refreshAssetOverrides();
 
   replyOKWithMsg(lastExistingParent(path));
 }
 
+/*
+   Handle bulk file operations, the progress is reported as chunked text/plain response,
+   one line per item ("OK <path>" or "FAILED <path>") and a final "DONE <ok>/<total>".
+   Operation      | request
+   ---------------+--------------------------------------------------------------
+   delete many    | DELETE /edit op=delete&path=..&path=..
+   move many      | PUT /edit op=move&src=..&path=..&src=..&path=..
+   copy           | PUT /edit op=copy&src=..&path=..  (files or whole folders)
+*/
+void EspSetup::handleFileBulk(const String &op) {
+  if (op != "delete" && op != "move" && op != "copy") {
+    return replyBadRequest(F("BAD OP"));
+  }
+
+  ChunkWriter writer(*pEspSetup);
+  writer.begin(200, "text/plain");
+
+  int total = 0, done = 0;
+  String src;
+  for (int i = 0; i < pEspSetup->args(); i++) {
+    const String &name = pEspSetup->argName(i);
+    if (name == "src") {
+      src = pEspSetup->arg(i);
+      continue;
+    }
+    if (name != "path") {
+      continue;
+    }
+    String path = pEspSetup->arg(i);
+    bool ok = !path.isEmpty() && path != "/";
+    if (op == "delete") {
+      ok = ok && EspFileSytem->exists(path) && deleteRecursive(path);
+    } else {
+      ok = ok && !src.isEmpty() && src != "/" && EspFileSytem->exists(src) && !EspFileSytem->exists(path);
+      if (ok && op == "move") {
+        if (path.endsWith("/")) path.remove(path.length() - 1);
+        if (src.endsWith("/")) src.remove(src.length() - 1);
+        ok = EspFileSytem->rename(src, path);
+      } else if (ok) {
+        ok = copyRecursive(src, path);
+      }
+      src = String();
+    }
+    pEspConsole->println(String("handleFileBulk: ") + op + ' ' + path + (ok ? " OK" : " FAILED"));
+    writer.print(ok ? F("OK ") : F("FAILED "));
+    writer.println(path);
+    writer.flush();   // report progress per item
+    total++;
+    if (ok) done++;
+  }
+  refreshAssetOverrides();
+
+  writer.printf("DONE %d/%d\n", done, total);
+  writer.end();
+}
+
 /*
    Handle a file upload request
 */
 // holds the currently running upload
 File fsUploadFile;
 bool uploadActive = false;
+String uploadPath;                      // final path, data goes to uploadPath.tmp until the upload ends
+uint8_t *uploadBuf = nullptr;           // flash block aligned write buffer
+size_t uploadLen = 0;
+bool uploadFailed = false;
+unsigned long uploadStart = 0;
+
+/*
+   Replace dst by src, LittleFS replaces an existing dst atomically
+*/
+bool replaceFile(const String &src, const String &dst) {
+  if (EspFileSytem->rename(src, dst)) {
+    return true;
+  }
+  EspFileSytem->remove(dst);
+  return EspFileSytem->rename(src, dst);
+}
+
+/*
+   Create the missing parent directories of path. open(path, "w") does this by itself,
+   rename() does not.
+*/
+bool makeParentDirs(const String &path) {
+  for (int i = path.indexOf('/', 1); i > 0; i = path.indexOf('/', i + 1)) {
+    String dir = path.substring(0, i);
+    if (!EspFileSytem->exists(dir) && !EspFileSytem->mkdir(dir)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+   Write the collected upload data as one block to the temp file
+*/
+bool flushUpload() {
+  bool ret = true;
+  if (uploadLen > 0) {
+    ret = fsUploadFile.write(uploadBuf, uploadLen) == uploadLen;
+    uploadLen = 0;
+  }
+  return ret;
+}
+
+/*
+   Close and remove the temp file, the previous content of uploadPath stays untouched
+*/
+void discardUpload() {
+  if (fsUploadFile) {
+    fsUploadFile.close();
+  }
+  EspFileSytem->remove(uploadPath + FILE_TMP_EXT);
+  if (uploadBuf) {
+    free(uploadBuf);
+    uploadBuf = nullptr;
+  }
+  uploadLen = 0;
+  uploadActive = false;
+}
 
 void EspSetup::handleFileUpload() {
   if (!fsOK) {
@@ -336,102 +977,895 @@ void EspSetup::handleFileUpload() {
   if (pEspSetup->uri() != "/edit") {
     return;
   }
-  uploadActive = true;
+  if (pEspSetup->hasArg("op")) {
+    return handleChunkUpload();
+  }
   HTTPUpload& upload = pEspSetup->upload();
   if (upload.status == UPLOAD_FILE_START) {
-    String filename = upload.filename;
+    if (uploadActive) {
+      discardUpload();                  // previous upload never finished
+    }
+    uploadActive = true;
+    uploadFailed = false;
+    uploadStart = millis();
+    uploadPath = upload.filename;
     // Make sure paths always start with "/"
-    if (!filename.startsWith("/")) {
-      filename = "/" + filename;
+    if (!uploadPath.startsWith("/")) {
+      uploadPath = "/" + uploadPath;
     }
-    pEspConsole->println(String("handleFileUpload Name: ") + filename);
-    fsUploadFile = EspFileSytem->open(filename, "w");
+    pEspConsole->println(String("Upload: START, filename: ") + uploadPath);
+    fsUploadFile = EspFileSytem->open(uploadPath + FILE_TMP_EXT, "w");
     if (!fsUploadFile) {
+      uploadFailed = true;
       return replyServerError(F("CREATE FAILED"));
     }
-    pEspConsole->println(String("Upload: START, filename: ") + filename);
+    // without a buffer the chunks are written as they arrive
+    uploadBuf = (uint8_t*) malloc(UPLOAD_BUFFER_SIZE);
+    uploadLen = 0;
   } else if (upload.status == UPLOAD_FILE_WRITE) {
-    if (fsUploadFile) {
-      size_t bytesWritten = fsUploadFile.write(upload.buf, upload.currentSize);
-      if (bytesWritten != upload.currentSize) {
-        return replyServerError(F("WRITE FAILED"));
+    if (!fsUploadFile || uploadFailed) {
+      return;
+    }
+    bool ok = true;
+    if (!uploadBuf) {
+      ok = fsUploadFile.write(upload.buf, upload.currentSize) == upload.currentSize;
+    } else {
+      size_t cnt = 0;
+      while (ok && cnt < upload.currentSize) {
+        size_t n = std::min(upload.currentSize - cnt, (size_t) UPLOAD_BUFFER_SIZE - uploadLen);
+        memcpy(&uploadBuf[uploadLen], &upload.buf[cnt], n);
+        uploadLen += n;
+        cnt += n;
+        if (uploadLen == UPLOAD_BUFFER_SIZE) ok = flushUpload();
       }
     }
-    pEspConsole->println(String("Upload: WRITE, Bytes: ") + upload.currentSize);
+    if (!ok) {
+      uploadFailed = true;
+      discardUpload();
+      return replyServerError(F("WRITE FAILED"));
+    }
+#ifdef DEBUG_VERBOSE
+    pEspConsole->printf("Upload: WRITE, Bytes: %u\n", upload.currentSize);
+#endif
   } else if (upload.status == UPLOAD_FILE_END) {
-    if (fsUploadFile) {
-      fsUploadFile.close();
-      uploadActive = false;
+    if (!fsUploadFile || uploadFailed) {
+      return;
     }
-    pEspConsole->println(String("Upload: END, Size: ") + upload.totalSize);
+    bool ok = flushUpload();
+    fsUploadFile.close();
+    free(uploadBuf);
+    uploadBuf = nullptr;
+    uploadActive = false;
+    // the new content becomes visible with the rename only
+    ok = ok && replaceFile(uploadPath + FILE_TMP_EXT, uploadPath);
+    if (!ok) {
+      discardUpload();
+      return replyServerError(F("WRITE FAILED"));
+    }
+    refreshAssetOverrides();
+    lastUploadSize = upload.totalSize;
+    lastUploadMillis = millis() - uploadStart;
+    pEspConsole->printf("Upload: END, Size: %u, Time: %lu ms, %lu B/s\n", upload.totalSize, lastUploadMillis,
+                        lastUploadMillis ? (unsigned long) (upload.totalSize * 1000ull / lastUploadMillis) : 0ul);
+  } else if (upload.status == UPLOAD_FILE_ABORTED) {
+    pEspConsole->println(String("Upload: ABORTED, filename: ") + uploadPath);
+    discardUpload();
   }
 }
 
-
 /*
-   Return the list of files in the directory specified by the "dir" query string parameter.
-   Also demonstrates the use of chuncked responses.
+   Resumable, checksummed uploads of large files (see tools/espupload.py).
+   The data is collected in UPLOAD_CHUNK_DIR/<id>.part and becomes visible at its
+   final path only after the size and SHA-256 of the whole file have been verified.
+   Request                                             | reply
+   ----------------------------------------------------+--------------------------------
+   POST /edit?op=begin&path=..&size=..&sha256=..       | {"id":"..","offset":0}
+   POST /edit?op=chunk&id=..&offset=..&crc=.. + data   | {"id":"..","offset":<committed>}
+   POST /edit?op=status&id=..                          | {"id":"..","offset":<committed>}
+   POST /edit?op=commit&id=..                          | {"id":"..","path":".."}
+   POST /edit?op=cancel&id=..                          | {"id":".."}
+   The chunk data is sent as multipart file part, crc is the CRC32 (zlib) of the chunk
+   as hex number. A chunk is only appended if its offset matches the committed offset,
+   otherwise 409 is returned together with the offset to resume from.
 */
-void EspSetup::handleFileList() {
-  if (!fsOK) {
-    return replyServerError(FPSTR(FS_INIT_ERROR));
+File chunkFile;
+int chunkStatus = 0;                    // HTTP error code of the current chunk, 0 if ok so far
+uint32_t chunkOffset = 0;               // committed size of the .part file before the chunk
+uint32_t chunkCrc = 0;
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *pData, size_t len) {
+  crc = ~crc;
+  while (len--) {
+    crc ^= *pData++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
   }
+  return ~crc;
+}
 
-  if (!pEspSetup->hasArg("dir")) {
-    return replyBadRequest(F("DIR ARG MISSING"));
+/*
+   Return the path of an upload file, the id is checked to be hex only
+*/
+String chunkPath(const String &id, const char *ext) {
+  if (id.isEmpty() || id.length() > 8) {
+    return String();
   }
-
-  String path = pEspSetup->arg("dir");
-  if (path != "/" && !EspFileSytem->exists(path)) {
-    return replyBadRequest("BAD PATH");
+  for (unsigned int i = 0; i < id.length(); i++) {
+    if (!isxdigit(id[i])) return String();
   }
+  return String(UPLOAD_CHUNK_DIR "/") + id + ext;
+}
 
-  pEspConsole->println(String("handleFileList: ") + path);
-  Dir dir = EspFileSytem->openDir(path);
-  path.clear();
-
-  // use HTTP/1.1 Chunked response to avoid building a huge temporary string
-  if (!pEspSetup->chunkedResponseModeStart(200, "text/json")) {
-    pEspSetup->send(505, F("text/html"), F("HTTP1.1 required"));
-    return;
-  }
+size_t chunkCommitted(const String &id) {
+  File file = EspFileSytem->open(chunkPath(id, ".part"), "r");
+  size_t size = file ? file.size() : 0;
+  file.close();
+  return size;
+}
 
-  // use the same string for every line
-  String output;
-  output.reserve(64);
+/*
+   Removes uploads pending longer than UPLOAD_CHUNK_MAX_AGE and the files of finished
+   ones, called at boot and by "begin". The age is taken from the NTP time of the begin
+   request; an upload begun without a valid time is aged by millis() and does not
+   survive a reboot.
+*/
+void chunkCleanup(bool boot) {
+  uint32_t utc = ntp.isValid() ? ntp.UtcTime() : 0;
+  std::vector<String> stale;            // not removed while the directory is iterated
+  Dir dir = EspFileSytem->openDir(UPLOAD_CHUNK_DIR);
   while (dir.next()) {
-    if (output.length()) {
-      // send string from previous iteration
-      // as an HTTP chunk
-      pEspSetup->sendContent(output);
-      output = ',';
-    } else {
-      output = '[';
-    }
-
-    output += "{\"type\":\"";
-    if (dir.isDirectory()) {
-      output += "dir";
-    } else {
-      output += F("file\",\"size\":\"");
-      output += dir.fileSize();
+    String name = dir.fileName();
+    String json = chunkPath(name.substring(0, name.indexOf('.')), ".json");
+    StaticJsonDocument<256> doc;
+    bool keep = !json.isEmpty() && EspFileSytem->exists(json) && pEspSetup->ReadFile(json, doc);
+    if (keep) {
+      uint32_t time = doc["time"].as<uint32_t>();
+      if (time) keep = !utc || utc - time < UPLOAD_CHUNK_MAX_AGE;
+      else keep = !boot && millis() - doc["ms"].as<uint32_t>() < UPLOAD_CHUNK_MAX_AGE * 1000UL;
     }
+    if (!keep) stale.push_back(name);
+  }
+  for (const String &name : stale) {
+    EspFileSytem->remove(String(UPLOAD_CHUNK_DIR "/") + name);
+  }
+  if (!stale.empty()) {
+    pEspConsole->printf("Chunked upload: %u stale files removed\n", (unsigned) stale.size());
+  }
+}
 
-    output += F("\",\"name\":\"");
-    // Always return names without leading "/"
-    if (dir.fileName()[0] == '/') {
-      output += &(dir.fileName()[1]);
-    } else {
-      output += dir.fileName();
+void replyChunkState(int code, const String &id, const String &path = String()) {
+  String json = "{\"id\":\"" + id + "\"";
+  if (path.isEmpty()) {
+    json += ",\"offset\":";
+    json += chunkCommitted(id);
+  } else {
+    json += ",\"path\":\"" + path + "\"";
+  }
+  json += "}";
+  pEspSetup->send(code, "application/json", json);
+}
+
+/*
+   Receive the data of a chunk, called by handleFileUpload() for each part
+*/
+void EspSetup::handleChunkUpload() {
+  HTTPUpload& upload = pEspSetup->upload();
+  if (upload.status == UPLOAD_FILE_START) {
+    String id = pEspSetup->arg("id");
+    String part = chunkPath(id, ".part");
+    chunkStatus = 0;
+    chunkCrc = 0;
+    if (pEspSetup->arg("op") != "chunk" || part.isEmpty() || !EspFileSytem->exists(chunkPath(id, ".json"))) {
+      chunkStatus = 404;
+      return;
+    }
+    chunkOffset = chunkCommitted(id);
+    if ((uint32_t) pEspSetup->arg("offset").toInt() != chunkOffset) {
+      chunkStatus = 409;
+      return;
+    }
+    chunkFile = EspFileSytem->open(part, "a");
+    if (!chunkFile) {
+      chunkStatus = 500;
+    }
+  } else if (upload.status == UPLOAD_FILE_WRITE) {
+    if (chunkStatus == 0) {
+      chunkCrc = crc32Update(chunkCrc, upload.buf, upload.currentSize);
+      if (chunkFile.write(upload.buf, upload.currentSize) != upload.currentSize) {
+        chunkStatus = 500;
+      }
+    }
+  } else if (upload.status == UPLOAD_FILE_END || upload.status == UPLOAD_FILE_ABORTED) {
+    if (!chunkFile) {
+      return;
+    }
+    if (chunkStatus == 0 && upload.status == UPLOAD_FILE_END) {
+      if (chunkCrc != strtoul(pEspSetup->arg("crc").c_str(), nullptr, 16)) {
+        chunkStatus = 422;
+      }
+    } else if (chunkStatus == 0) {
+      chunkStatus = 400;
+    }
+    // drop a broken chunk, the client resumes from the last committed offset
+    if (chunkStatus != 0) {
+      chunkFile.truncate(chunkOffset);
+    }
+    chunkFile.close();
+  }
+}
+
+/*
+   Handle the requests of the resumable upload protocol, called when the request has ended
+*/
+void EspSetup::handleChunkRequest() {
+  if (!fsOK) {
+    return replyServerError(FPSTR(FS_INIT_ERROR));
+  }
+  String op = pEspSetup->arg("op");
+  String id = pEspSetup->arg("id");
+
+  if (op == "begin") {
+    String path = pEspSetup->arg("path");
+    if (path.isEmpty() || path == "/" || !pEspSetup->hasArg("size") || pEspSetup->arg("sha256").length() != 64) {
+      return replyBadRequest(F("BAD ARGS"));
+    }
+    if (!path.startsWith("/")) {
+      path = "/" + path;
+    }
+    chunkCleanup(false);
+    char buf[12];
+    snprintf(buf, sizeof(buf), "%08x", ESP.random());
+    id = buf;
+    StaticJsonDocument<256> doc;
+    doc["path"] = path;
+    doc["size"] = pEspSetup->arg("size").toInt();
+    doc["sha256"] = pEspSetup->arg("sha256");
+    doc["time"] = ntp.isValid() ? ntp.UtcTime() : 0;
+    doc["ms"] = millis();
+    File part = EspFileSytem->open(chunkPath(id, ".part"), "w");
+    bool ok = part;
+    part.close();
+    if (!ok || !pEspSetup->WriteFile(chunkPath(id, ".json"), doc)) {
+      return replyServerError(F("CREATE FAILED"));
+    }
+    pEspConsole->println(String("Chunked upload: BEGIN, id: ") + id + " filename: " + path);
+    return replyChunkState(200, id);
+  }
+
+  StaticJsonDocument<256> doc;
+  if (chunkPath(id, ".json").isEmpty() || !pEspSetup->ReadFile(chunkPath(id, ".json"), doc)) {
+    return replyNotFound(F("UPLOAD ID NOT FOUND"));
+  }
+
+  if (op == "chunk") {
+    int code = chunkStatus ? chunkStatus : 200;
+    chunkStatus = 0;
+    return replyChunkState(code, id);
+  } else if (op == "status") {
+    return replyChunkState(200, id);
+  } else if (op == "cancel") {
+    EspFileSytem->remove(chunkPath(id, ".part"));
+    EspFileSytem->remove(chunkPath(id, ".json"));
+    return replyChunkState(200, id, doc["path"].as<String>());
+  } else if (op == "commit") {
+    String path = doc["path"].as<String>();
+    File file = EspFileSytem->open(chunkPath(id, ".part"), "r");
+    bool ok = file && file.size() == doc["size"].as<size_t>();
+    // verify the whole file before it becomes visible
+    if (ok) {
+      br_sha256_context ctx;
+      br_sha256_init(&ctx);
+      uint8_t buf[FILE_COPY_CHUNK_SIZE];
+      while (file.available()) {
+        size_t len = file.read(buf, sizeof(buf));
+        if (len == 0) break;
+        br_sha256_update(&ctx, buf, len);
+        yield();
+      }
+      uint8_t hash[br_sha256_SIZE];
+      br_sha256_out(&ctx, hash);
+      char hex[2 * br_sha256_SIZE + 1];
+      for (int i = 0; i < br_sha256_SIZE; i++) {
+        sprintf(&hex[2 * i], "%02x", hash[i]);
+      }
+      ok = doc["sha256"].as<String>().equalsIgnoreCase(hex);
+    }
+    file.close();
+    if (!ok) {
+      pEspConsole->println(String("Chunked upload: VERIFY FAILED, id: ") + id);
+      return replyChunkState(422, id);
+    }
+    if (!makeParentDirs(path) || !replaceFile(chunkPath(id, ".part"), path)) {
+      return replyServerError(F("RENAME FAILED"));
+    }
+    EspFileSytem->remove(chunkPath(id, ".json"));
+    refreshAssetOverrides();
+    pEspConsole->println(String("Chunked upload: END, filename: ") + path);
+    return replyChunkState(200, id, path);
+  }
+  replyBadRequest(F("BAD OP"));
+}
+
+/*
+   Return the list of files in the directory specified by the "dir" query string parameter.
+   Optional parameters:
+     offset     number of entries to skip (pagination)
+     limit      maximum number of entries to return (pagination)
+     recursive  also list the content of sub folders, names are relative to "dir"
+   Entries are coalesced into chunks of one TCP segment by the ChunkWriter.
+*/
+void EspSetup::handleFileList() {
+  if (!fsOK) {
+    return replyServerError(FPSTR(FS_INIT_ERROR));
+  }
+
+  if (!pEspSetup->hasArg("dir")) {
+    return replyBadRequest(F("DIR ARG MISSING"));
+  }
+
+  String path = pEspSetup->arg("dir");
+  if (path != "/" && !EspFileSytem->exists(path)) {
+    return replyBadRequest("BAD PATH");
+  }
+
+  long offset = pEspSetup->hasArg("offset") ? pEspSetup->arg("offset").toInt() : 0;
+  long limit = pEspSetup->hasArg("limit") ? pEspSetup->arg("limit").toInt() : -1;
+  bool recursive = pEspSetup->hasArg("recursive") && pEspSetup->arg("recursive") != "0";
+
+  pEspConsole->println(String("handleFileList: ") + path);
+  if (!path.endsWith("/")) {
+    path += '/';
+  }
+
+  // use HTTP/1.1 Chunked response to avoid building a huge temporary string
+  ChunkWriter writer(*pEspSetup);
+  writer.begin(200, "application/json");
+
+  // sub folders still to be listed, relative to path
+  std::vector<String> pending;
+  pending.push_back(String());
+
+  long count = 0;
+  writer.print('[');
+  while (!pending.empty() && limit != 0) {
+    String sub = pending.back();
+    pending.pop_back();
+    Dir dir = EspFileSytem->openDir(path + sub);
+
+    while (limit != 0 && dir.next()) {
+      // Always return names without leading "/"
+      String fileName = dir.fileName();
+      if (fileName[0] == '/') {
+        fileName.remove(0, 1);
+      }
+      fileName = sub + fileName;
+      if (recursive && dir.isDirectory()) {
+        pending.push_back(fileName + '/');
+      }
+      if (offset > 0) {
+        offset--;
+        continue;
+      }
+
+      if (count++) {
+        writer.print(',');
+      }
+      writer.print(F("{\"type\":\""));
+      if (dir.isDirectory()) {
+        writer.print(F("dir"));
+      } else {
+        writer.print(F("file\",\"size\":\""));
+        writer.print(dir.fileSize());
+      }
+      writer.print(F("\",\"name\":\""));
+      writer.print(fileName);
+      writer.print(F("\"}"));
+      if (limit > 0) limit--;
+    }
+  }
+  writer.print(']');
+  writer.end();
+}
+
+// === class ConsoleLog ===
+
+size_t ConsoleLog::write(const uint8_t *pData, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    ring[head % LOG_RING_SIZE] = pData[i];
+    if (++head % LOG_RING_SIZE == 0) wrapped = true;
+  }
+  return out.write(pData, size);
+}
+
+int ConsoleLog::ReadLine(uint32_t &rPos, char *pBuffer, size_t size) const {
+  if (Lost(rPos)) {
+    rPos = Tail();
+  }
+  size_t len = 0;
+  for (uint32_t pos = rPos; pos != head; pos++) {
+    char c = ring[pos % LOG_RING_SIZE];
+    if (c == '\n' || len + 1 >= size) {
+      pBuffer[len] = '\0';
+      rPos = (c == '\n') ? pos + 1 : pos;
+      return len;
+    }
+    if (c != '\r') pBuffer[len++] = c;
+  }
+  return -1;    // line not complete yet
+}
+
+// === Server-Sent Events ===
+
+struct EventClient
+{
+  WiFiClient    client;
+  uint32_t      pos;          // next log position to send
+  unsigned long lastSend;     // for the keep alive comment
+};
+
+static EventClient eventClients[MAX_EVENT_CLIENTS];
+
+/*
+   Subscribe to the console output: GET /events[?history=0]
+   The log still held in RAM is replayed first unless history=0 is given.
+*/
+void EspSetup::handleEvents() {
+  if (!pEspSetup->CheckWebServerCredentials()) {
+    return;
+  }
+  for (EventClient &ec : eventClients) {
+    if (!ec.client || !ec.client.connected()) {
+      ec.client = pEspSetup->client();
+      ec.client.setNoDelay(true);
+      ec.pos = (pEspSetup->arg("history") == "0") ? pEspLog->Head() : pEspLog->Tail();
+      ec.lastSend = millis();
+      // the response goes on forever, write the header directly
+      pEspSetup->KeepAliveRelease();
+      pEspSetup->setContentLength(CONTENT_LENGTH_UNKNOWN);
+      pEspSetup->sendContent(F("HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                               "Connection: keep-alive\r\nAccess-Control-Allow-Origin: *\r\n\r\n"));
+      pEspConsole->println("/events client subscribed");
+      return;
+    }
+  }
+  pEspSetup->send(503, FPSTR(TEXT_PLAIN), F("TOO MANY EVENT CLIENTS"));
+}
+
+/*
+   Push new console lines to the subscribers. Only as much is written as the socket
+   accepts without blocking, a slow consumer that falls behind the ring buffer loses
+   the overwritten lines.
+*/
+void EspSetup::EventLoop() {
+  char line[LOG_LINE_MAX];
+  char event[LOG_LINE_MAX + 8];
+
+  for (EventClient &ec : eventClients) {
+    if (!ec.client) continue;
+    if (!ec.client.connected()) {
+      ec.client.stop();
+      ec.client = WiFiClient();
+      continue;
+    }
+    if (console.Lost(ec.pos)) {
+      ec.pos = console.Tail();
+      if (ec.client.availableForWrite() > 16) ec.client.print(F(": dropped\n\n"));
+    }
+    while (true) {
+      uint32_t pos = ec.pos;
+      int len = console.ReadLine(pos, line, sizeof(line));
+      if (len < 0) break;
+      len = snprintf(event, sizeof(event), "data: %s\n\n", line);
+      if (ec.client.availableForWrite() < len) break;   // retry on the next loop
+      ec.client.write((const uint8_t*) event, len);
+      ec.pos = pos;
+      ec.lastSend = millis();
     }
+    // keep alive comment, also detects connections closed by the browser
+    if (millis() - ec.lastSend > 15000 && ec.client.availableForWrite() > 8) {
+      ec.client.print(F(": ping\n\n"));
+      ec.lastSend = millis();
+    }
+  }
+
+  // WebSocket clients subscribed by "EspSetupLog"
+  for (int num = 0; webSocketLogMask && num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+    if (webSocketLogMask & (1u << num)) {
+      memcpy(event, "EspSetupLog ", 12);
+      while (console.ReadLine(webSocketLogPos[num], &event[12], sizeof(event) - 12) >= 0) {
+        EspWebSocket.sendTXT(num, event);
+      }
+    }
+  }
+}
+
+// === OTA update over HTTP and WebSocket ===
+
+/*
+   Firmware images are streamed straight into the free flash behind the running sketch,
+   the eboot loader copies it over the sketch on the next boot. Filesystem images are
+   written to the LittleFS partition. Before an image is committed its MD5 (Updater)
+   and SHA-256 (if given) are verified, a mismatch discards the image.
+*/
+static bool     otaActive = false;
+static int      otaCommand = U_FLASH;
+static size_t   otaSize = 0;              // expected size, 0 if unknown (HTTP multipart)
+static size_t   otaWritten = 0;
+static int      otaPercent = -1;          // last progress broadcast
+static String   otaSha256;
+static br_sha256_context otaShaCtx;
+static unsigned long otaReboot = 0;       // restart scheduled at this time after success
+static DeltaDecoder *otaDelta = nullptr;  // set while a delta patch is applied
+static size_t   otaReceived = 0;          // input bytes (image or patch)
+static size_t   otaInputSize = 0;
+static int      otaOwner = OTA_OWNER_NONE; // WebSocket client number or OTA_OWNER_HTTP
+static bool     otaHttpUpload = false;    // the current HTTP upload passed the start checks
+static int      otaHttpStatus = 400;      // reply of handleUpdate() if not 200/500, set by the upload start
+
+void otaProgress(const char *state) {
+  char json[112];
+  snprintf(json, sizeof(json), "{\"ota\":{\"state\":\"%s\",\"done\":%u,\"total\":%u,\"received\":%u}}",
+           state, (unsigned) otaWritten, (unsigned) otaSize, (unsigned) otaReceived);
+  pEspSetup->WebSocketBroadcast(json);
+}
+
+bool otaBegin(int command, size_t size, const String &md5, const String &sha256) {
+  if (otaActive) {
+    Update.end();                         // drop an update that never finished
+  }
+  size_t maxSize;
+  if (command == U_FS) {
+    maxSize = (size_t) &_FS_end - (size_t) &_FS_start;
+    EspFileSytem->end();                  // the image replaces the mounted filesystem
+    fsOK = false;
+  } else {
+    maxSize = (ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000;
+  }
+  if (size > maxSize || !Update.begin(size ? size : maxSize, command)) {
+    pEspConsole->println(size > maxSize ? "OTA: image too large" : "OTA: begin failed");
+    if (command == U_FS) fsOK = EspFileSytem->begin();
+    return false;
+  }
+  if (md5.length() == 32) {
+    Update.setMD5(md5.c_str());
+  }
+  otaSha256 = sha256;
+  br_sha256_init(&otaShaCtx);
+  otaActive = true;
+  otaCommand = command;
+  otaSize = size;
+  otaWritten = 0;
+  otaPercent = -1;
+  pEspConsole->printf("OTA: START %s, size: %u\n", command == U_FS ? "filesystem" : "firmware", size);
+  otaProgress("start");
+  return true;
+}
+
+bool otaWrite(uint8_t *pData, size_t len) {
+  if (!otaActive) return false;
+  br_sha256_update(&otaShaCtx, pData, len);
+  if (Update.write(pData, len) != len) {
+    Update.printError(*pEspConsole);
+    return false;
+  }
+  otaWritten += len;
+  int percent = otaSize ? (int) ((uint64_t) otaWritten * 100 / otaSize) : 0;
+  if (otaSize && percent >= otaPercent + OTA_PROGRESS_STEP) {
+    otaPercent = percent;
+    otaProgress("progress");
+  }
+  return true;
+}
+
+bool otaEnd() {
+  if (!otaActive) return false;
+  otaActive = false;
+  otaOwner = OTA_OWNER_NONE;
+  if (otaSha256.length() == 64) {
+    uint8_t hash[br_sha256_SIZE];
+    char hex[2 * br_sha256_SIZE + 1];
+    br_sha256_out(&otaShaCtx, hash);
+    for (int i = 0; i < br_sha256_SIZE; i++) {
+      sprintf(&hex[2 * i], "%02x", hash[i]);
+    }
+    if (!otaSha256.equalsIgnoreCase(hex)) {
+      pEspConsole->println("OTA: SHA-256 mismatch");
+      // an impossible MD5 makes the Updater discard the image
+      Update.setMD5("00000000000000000000000000000000");
+    }
+  }
+  // unknown size (HTTP multipart): commit what has been received
+  if (!Update.end(otaSize == 0)) {
+    Update.printError(*pEspConsole);
+    otaProgress("error");
+    if (otaCommand == U_FS) fsOK = EspFileSytem->begin();
+    return false;
+  }
+  pEspConsole->printf("OTA: END, size: %u\n", otaWritten);
+  otaProgress("done");
+  otaReboot = millis() | 1;
+  return true;
+}
+
+void otaAbort() {
+  delete otaDelta;
+  otaDelta = nullptr;
+  otaOwner = OTA_OWNER_NONE;
+  if (otaActive) {
+    otaActive = false;
+    Update.end();                         // fails for a partial image and resets the Updater
+    if (otaCommand == U_FS) fsOK = EspFileSytem->begin();
+    pEspConsole->println("OTA: ABORTED");
+    otaProgress("error");
+  }
+}
+
+/*
+   Compares a received password in constant time, the time depends on the length of
+   the configured one only (like the session MAC check)
+*/
+static bool otaPassMatches(const char *pGiven, const String &secret) {
+  size_t len = strlen(pGiven);
+  uint8_t diff = (len != secret.length());
+  for (size_t i = 0; i < secret.length(); i++) {
+    diff |= (uint8_t) secret[i] ^ (uint8_t) (i < len ? pGiven[i] : 0);
+  }
+  return diff == 0;
+}
+
+/*
+   Delta updates (type "delta") carry a patch against the running sketch made by
+   tools/espdelta.py. The patch is applied while it is received: unchanged parts are
+   read from the running sketch in flash, the result goes through otaWrite() like a
+   plain image. md5/sha256 refer to the new image, the patch header carries its MD5 too.
+*/
+static bool otaDeltaHeader(const DeltaDecoder &delta) {
+  char md5[33];
+  const uint8_t *p = delta.OldMd5();
+  for (int i = 0; i < 16; i++) {
+    sprintf(&md5[2 * i], "%02x", p[i]);
+  }
+  if (delta.OldSize() != ESP.getSketchSize() || ESP.getSketchMD5() != md5) {
+    pEspConsole->println("OTA: delta patch does not match the running sketch");
+    return false;
+  }
+  p = delta.NewMd5();
+  for (int i = 0; i < 16; i++) {
+    sprintf(&md5[2 * i], "%02x", p[i]);
+  }
+  return otaBegin(U_FLASH, delta.NewSize(), md5, otaSha256);
+}
+
+// a session of another client is running
+static bool otaBusy(int owner) {
+  return (otaActive || otaDelta) && otaOwner != OTA_OWNER_NONE && otaOwner != owner;
+}
+
+/*
+   Only the owner, the client that started the session, feeds, finishes or aborts it.
+   A new start of the owner drops its session that never finished, the start of another
+   client is refused while a session runs (see otaBusy()).
+*/
+bool otaStart(int owner, const String &type, size_t size, const String &md5, const String &sha256) {
+  if (otaBusy(owner)) {
+    pEspConsole->println("OTA: busy, another client is updating");
+    return false;
+  }
+  otaAbort();
+  otaReceived = 0;
+  otaInputSize = size;
+  if (type != "delta") {
+    if (!otaBegin(type == "fs" ? U_FS : U_FLASH, size, md5, sha256)) return false;
+    otaOwner = owner;
+    return true;
+  }
+  otaOwner = owner;
+  otaSha256 = sha256;                     // otaBegin() is called with the header
+  otaDelta = new DeltaDecoder(
+    [](uint32_t offset, uint8_t *pData, size_t len) { return ESP.flashRead(offset, (uint32_t*) pData, len); },
+    [](const uint8_t *pData, size_t len) { return otaWrite((uint8_t*) pData, len); },
+    otaDeltaHeader);
+  pEspConsole->printf("OTA: START delta, patch size: %u\n", (unsigned) size);
+  return true;
+}
+
+bool otaFeed(uint8_t *pData, size_t len) {
+  otaReceived += len;
+  if (otaDelta) {
+    return otaDelta->Write(pData, len);
+  }
+  return otaActive && otaWrite(pData, len);
+}
+
+bool otaFinish() {
+  if (otaDelta) {
+    bool done = otaDelta->Done();
+    delete otaDelta;
+    otaDelta = nullptr;
+    if (!done) {
+      pEspConsole->println("OTA: delta patch incomplete");
+      otaAbort();
+      otaProgress("error");
+      return false;
+    }
+  }
+  return otaEnd();
+}
+
+/*
+   HTTP upload: POST /update[?type=fs|delta][&md5=..][&sha256=..] multipart image, the OTA
+   password in the X-OTA-Password header (not in the URL, it would end up in logs)
+*/
+void EspSetup::handleUpdateUpload() {
+  HTTPUpload& upload = pEspSetup->upload();
+  if (upload.status == UPLOAD_FILE_START) {
+    // nothing is sent from here, handleUpdate() replies once the request has ended
+    otaHttpUpload = false;
+    otaHttpStatus = 401;
+    if (!pEspSetup->WebServerAuthorized()) {
+      return;
+    }
+    otaHttpStatus = 403;
+    if (!pEspSetup->otaPass.isEmpty() && !otaPassMatches(pEspSetup->header("X-OTA-Password").c_str(), pEspSetup->otaPass)) {
+      pEspConsole->println("OTA: authentication failed");
+      return;
+    }
+    otaHttpStatus = otaBusy(OTA_OWNER_HTTP) ? 409 : 0;
+    otaHttpUpload = otaStart(OTA_OWNER_HTTP, pEspSetup->arg("type"), pEspSetup->arg("size").toInt(), pEspSetup->arg("md5"), pEspSetup->arg("sha256"));
+  } else if (otaHttpUpload && otaOwner == OTA_OWNER_HTTP) {
+    // only the upload that started the session
+    if (upload.status == UPLOAD_FILE_WRITE) {
+      if ((otaActive || otaDelta) && !otaFeed(upload.buf, upload.currentSize)) {
+        otaAbort();
+      }
+    } else if (upload.status == UPLOAD_FILE_END) {
+      otaFinish();
+    } else if (upload.status == UPLOAD_FILE_ABORTED) {
+      otaAbort();
+    }
+  }
+  yield();
+}
+
+void EspSetup::handleUpdate() {
+  int status = otaHttpStatus;
+  otaHttpStatus = 400;                    // a request without an image part
+  if (!pEspSetup->CheckWebServerCredentials()) {
+    return;
+  }
+  if (status == 401) {
+    pEspSetup->requestAuthentication();   // the login was blocked when the upload started
+  } else if (status == 403) {
+    pEspSetup->send(403, FPSTR(TEXT_PLAIN), F("OTA PASSWORD REQUIRED"));
+  } else if (status == 409) {
+    pEspSetup->send(409, FPSTR(TEXT_PLAIN), F("OTA BUSY"));
+  } else if (status == 400) {
+    replyBadRequest(F("NO IMAGE"));
+  } else if (otaReboot) {
+    pEspSetup->send(200, FPSTR(TEXT_PLAIN), F("OK, rebooting"));
+  } else {
+    pEspSetup->send(500, FPSTR(TEXT_PLAIN), Update.hasError() ? Update.getErrorString() : String(F("UPDATE FAILED")));
+  }
+}
+
+/*
+   WebSocket upload:
+   text   EspSetupOta{"type":"fw|fs|delta","size":n,"md5":"..","sha256":"..","pass":".."}
+   binary [offset uint32 LE][crc32 uint32 LE][data], in order; a frame with a wrong offset
+          or CRC is rejected by a "resend" reply, "received" is the offset to continue from.
+   Replies and progress are {"ota":{"state":..,"done":..,"total":..,"received":..}} messages,
+   done/total count bytes of the (new) image, received counts bytes of the upload.
+*/
+bool EspSetup::WebSocketOta(uint8_t num, WStype_t type, uint8_t *payload, size_t len) {
+  if (type == WStype_TEXT && len >= 11 && !strncmp((const char*) payload, "EspSetupOta", 11)) {
+    StaticJsonDocument<384> doc;
+    bool ok = !deserializeJson(doc, (const char*) &payload[11], len - 11);
+    if (ok && !otaPass.isEmpty() && !otaPassMatches(doc["pass"] | "", otaPass)) {
+      console.println("OTA: authentication failed");
+      ok = false;
+    }
+    if (ok && otaBusy(num)) {
+      EspWebSocket.sendTXT(num, "{\"ota\":{\"state\":\"busy\"}}");   // to this client only, not the owner
+      return true;
+    }
+    ok = ok && doc["size"].as<size_t>() > 0
+            && otaStart(num, doc["type"] | "fw", doc["size"], doc["md5"] | "", doc["sha256"] | "");
+    if (!ok) otaProgress("error");
+    return true;
+  }
+  if (type == WStype_DISCONNECTED && otaOwner == num) {
+    otaAbort();                           // remounts the filesystem of an unfinished "fs" image
+    return false;
+  }
+  if (type == WStype_BIN && otaOwner == num) {
+    uint32_t offset, crc;
+    if (len < 8) return true;
+    memcpy(&offset, payload, 4);
+    memcpy(&crc, &payload[4], 4);
+    if (offset != otaReceived || crc != crc32Update(0, &payload[8], len - 8)) {
+      otaProgress("resend");
+      return true;
+    }
+    if (!otaFeed(&payload[8], len - 8)) {
+      otaAbort();
+    } else if (otaReceived >= otaInputSize) {
+      otaFinish();
+    }
+    return true;
+  }
+  return false;
+}
+
+// === class ChunkWriter ===
+
+static char *responseBuffers[RESPONSE_BUFFER_COUNT];
+static bool  responseBufferUsed[RESPONSE_BUFFER_COUNT];
+
+// buffers are allocated on first use and kept for the lifetime of the application
+char* ChunkWriter::AcquireBuffer() {
+  for (int i = 0; i < RESPONSE_BUFFER_COUNT; i++) {
+    if (!responseBufferUsed[i]) {
+      if (!responseBuffers[i]) responseBuffers[i] = (char*) malloc(RESPONSE_BUFFER_SIZE);
+      if (!responseBuffers[i]) return nullptr;
+      responseBufferUsed[i] = true;
+      return responseBuffers[i];
+    }
+  }
+  return nullptr;
+}
+
+void ChunkWriter::ReleaseBuffer(char *pBuffer) {
+  for (int i = 0; i < RESPONSE_BUFFER_COUNT; i++) {
+    if (responseBuffers[i] == pBuffer) responseBufferUsed[i] = false;
+  }
+}
+
+bool ChunkWriter::begin(int code, const char *pContentType) {
+  if (!server.chunkedResponseModeStart(code, pContentType)) {
+    // HTTP/1.0: no chunks, the end of the response is marked by closing the connection
+    server.keepAlive(false);
+    server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    server.send(code, pContentType, "");
+  }
+  pBuf = AcquireBuffer();   // without a buffer every write is sent as its own chunk
+  len = 0;
+  active = true;
+  return true;
+}
 
-    output += "\"}";
+void ChunkWriter::end() {
+  if (active) {
+    flush();
+    server.chunkedResponseFinalize();
+    ReleaseBuffer(pBuf);
+    pBuf = nullptr;
+    active = false;
   }
+}
 
-  // send last string
-  output += "]";
-  pEspSetup->sendContent(output);
-  pEspSetup->chunkedResponseFinalize();
+size_t ChunkWriter::write(const uint8_t *pData, size_t size) {
+  if (!active) return 0;
+  if (!pBuf) {
+    server.sendContent((const char*) pData, size);
+    return size;
+  }
+  size_t cnt = 0;
+  while (cnt < size) {
+    size_t n = std::min(size - cnt, (size_t) RESPONSE_BUFFER_SIZE - len);
+    memcpy(&pBuf[len], &pData[cnt], n);
+    len += n;
+    cnt += n;
+    if (len == RESPONSE_BUFFER_SIZE) flush();
+  }
+  return cnt;
+}
+
+void ChunkWriter::flush() {
+  if (active && pBuf && len > 0) {
+    server.sendContent(pBuf, len);
+    len = 0;
+  }
 }
 
 // === class EspSetup ===
@@ -441,13 +1875,18 @@ EspSetup::EspSetup(Stream& s, int port) : ESP8266WebServer(port), console(s)
 {
   pEspSetup = this;
   pEspConsole = &console;
+  pEspLog = &console;
 }
 
 // Dtor delete UDP/TCP sockets
 EspSetup::~EspSetup()
 {
   if (pUdp) delete pUdp;
+  if (pDns) delete pDns;
+  delete pTelnetService;
   if (pTcp) delete pTcp;
+  delete[] pUdpRecv;
+  delete[] pUdpSend;
 }
 
 FS* EspSetup::GetFS()
@@ -455,16 +1894,326 @@ FS* EspSetup::GetFS()
   return EspFileSytem;
 }
 
+/*
+   The collected headers are searched by index, header("Cookie") would build a String
+   key and return a copy on every request
+*/
+const char* EspSetup::requestCookie() {
+  for (int i = 0; i < headers(); i++) {
+    if (!strcasecmp(headerName(i).c_str(), "Cookie")) return header(i).c_str();
+  }
+  return nullptr;
+}
+
+/*
+   The checks of CheckWebServerCredentials() without sending a reply, failures are not
+   counted. For upload callbacks, their route handler replies after the upload.
+*/
+bool EspSetup::WebServerAuthorized() {
+  if (webUser == "" || webPass == "") {
+    return true;
+  }
+  IPAddress ip = client().remoteIP();
+  if (CheckSessionCookie(requestCookie(), ip)) {
+    return true;
+  }
+  AuthFailure *pFailure = authFailure(ip, false);
+  if (pFailure && pFailure->count >= AUTH_FAIL_MAX && millis() - pFailure->lastMillis < AUTH_BLOCK_TIME) {
+    return false;
+  }
+  return authenticate(webUser.c_str(), webPass.c_str());
+}
+
+/*
+   A valid session cookie saves decoding and comparing the credentials of every request.
+   After a successful Basic/Digest login the response sets the cookie, it is bound to the
+   client IP and expires after AUTH_SESSION_TIME. A client IP with AUTH_FAIL_MAX failed
+   logins in a row is refused for AUTH_BLOCK_TIME.
+*/
 bool EspSetup::CheckWebServerCredentials() {
-  if (webUser != "" && webPass != "") {
-    if (!authenticate(webUser.c_str(), webPass.c_str())) {
-      requestAuthentication();
+  if (webUser == "" || webPass == "") {
+    return true;
+  }
+  IPAddress ip = client().remoteIP();
+  if (CheckSessionCookie(requestCookie(), ip)) {
+    return true;
+  }
+  AuthFailure *pFailure = authFailure(ip, false);
+  if (pFailure && pFailure->count >= AUTH_FAIL_MAX) {
+    uint32_t blocked = millis() - pFailure->lastMillis;
+    if (blocked < AUTH_BLOCK_TIME) {
+      sendHeader("Retry-After", String((AUTH_BLOCK_TIME - blocked) / 1000 + 1));
+      send(429, FPSTR(TEXT_PLAIN), "Too many failed logins");
       return false;
     }
+    pFailure->count = 0;
+  }
+  if (!authenticate(webUser.c_str(), webPass.c_str())) {
+    if (hasHeader("Authorization")) {           // not the first request of the browser
+      pFailure = authFailure(ip, true);
+      pFailure->count++;
+      pFailure->lastMillis = millis();
+      console.printf("Login from %s failed (%d)\n", ip.toString().c_str(), pFailure->count);
+    }
+    requestAuthentication();
+    return false;
   }
+  if (pFailure) {
+    pFailure->count = 0;
+  }
+  uint32_t expiry = millis() + AUTH_SESSION_TIME * 1000UL;
+  char token[SESSION_TOKEN_LEN + 1];
+  sprintf(token, "%08x", (unsigned int) expiry);
+  sessionMac(expiry, ip, &token[8]);
+  sendHeader("Set-Cookie", String(F(SESSION_COOKIE)) + token + F("; Path=/; Max-Age=") + AUTH_SESSION_TIME + F("; HttpOnly; SameSite=Strict"));
+  sessionIssued = true;
   return true;
 }
 
+/*
+   Looks up the session token in a Cookie header value and verifies it without
+   allocating. All digits are compared, the time does not tell how many matched.
+*/
+bool EspSetup::CheckSessionCookie(const char *pCookie, const IPAddress &ip) {
+  if (webUser == "" || webPass == "") {
+    return true;
+  }
+  const char *p = pCookie ? strstr(pCookie, SESSION_COOKIE) : nullptr;
+  if (!p) {
+    return false;
+  }
+  p += sizeof(SESSION_COOKIE) - 1;
+  uint32_t expiry = 0;
+  for (int i = 0; i < 8; i++) {
+    int digit = hexValue(p[i]);
+    if (digit < 0) return false;
+    expiry = (expiry << 4) | digit;
+  }
+  int32_t left = (int32_t) (expiry - millis());
+  if (left <= 0 || left > (int32_t) (AUTH_SESSION_TIME * 1000UL)) {
+    return false;
+  }
+  char mac[SESSION_TOKEN_LEN - 8 + 1];
+  sessionMac(expiry, ip, mac);
+  uint8_t diff = 0;
+  for (int i = 0; i < SESSION_TOKEN_LEN - 8; i++) {
+    if (!p[8 + i]) return false;
+    diff |= p[8 + i] ^ mac[i];
+  }
+  return diff == 0;
+}
+
+void EspSetup::handleEditPage() {
+  if (pEspSetup->CheckWebServerCredentials()) {
+    if (!handleFileRead(F("/esp/edit.htm"))) {
+      replyNotFound(FPSTR(FILE_NOT_FOUND));
+    }
+  }
+}
+
+/*
+   Called after the request has ended with all parsed arguments, the upload itself
+   is handled by handleFileUpload()
+*/
+void EspSetup::handleEditPost() {
+  if (pEspSetup->hasArg("op")) {
+    handleChunkRequest();
+  } else {
+    pEspSetup->send(200, "text/plain", "");
+  }
+}
+
+// return WiFi setup page (setup.htm)
+void EspSetup::handleSetupPage() {
+  if (pEspSetup->CheckWebServerCredentials()) {
+    if (!handleFileRead(F("/esp/setup.htm"))) {
+      replyNotFound(FPSTR(FILE_NOT_FOUND));
+    }
+  }
+}
+
+// editor reset
+void EspSetup::handleReboot() {
+  replyNotFound(FPSTR(FILE_NOT_FOUND));
+  delay(100);
+  ESP.reset();
+}
+
+// get heap status, analog input value and all GPIO statuses in one json call
+void EspSetup::handleAll() {
+  String json = "{";
+  json += "\"heap\":" + String(ESP.getFreeHeap());
+  json += ", \"analog\":" + String(analogRead(A0));
+  json += ", \"gpio\":" + String((uint32_t)(((GPI | GPO) & 0xFFFF) | ((GP16I & 0x01) << 16)));
+  json += "}";
+  pEspSetup->send(200, "application/json", json);
+}
+
+/*
+   In AP mode a request for a foreign host is a connectivity check or a page typed
+   before the captive portal showed up, send it to the setup page.
+*/
+bool EspSetup::captiveRedirect() {
+  String ap = WiFi.softAPIP().toString();
+  if (!pEspSetup->isApMode || pEspSetup->hostHeader() == ap || pEspSetup->hostHeader().startsWith(ap + ":")) {
+    return false;
+  }
+  replyRedirectSetup();
+  return true;
+}
+
+// connectivity check URLs of Android, iOS/macOS, Windows and Firefox, AP mode only
+void EspSetup::handleCaptive() {
+  replyRedirectSetup();
+}
+
+/*
+   GET /log?name=..[&from=..][&to=..][&format=json]
+   from/to are UTC as seconds since 1970 or ISO 8601 (2020-07-19T12:00:00), default all records
+*/
+void EspSetup::handleLogQuery() {
+  if (!pEspSetup->CheckWebServerCredentials()) {
+    return;
+  }
+  DataLogger *pLogger = nullptr;
+  for (DataLogger *p : pEspSetup->LoggerList) {
+    if (p->Name() == pEspSetup->arg("name")) pLogger = p;
+  }
+  if (!pLogger) {
+    replyNotFound(F("Logger not found"));
+    return;
+  }
+  auto parseTime = [](const String &arg, time_t def) -> time_t {
+    if (arg.isEmpty()) return def;
+    return (arg.indexOf('-') > 0) ? ntp.fromIsoDateTimeString(arg) : (time_t) strtoul(arg.c_str(), nullptr, 10);
+  };
+  time_t from = parseTime(pEspSetup->arg("from"), 0);
+  time_t to = parseTime(pEspSetup->arg("to"), std::numeric_limits<time_t>::max());   // time_t is signed
+  bool json = pEspSetup->arg("format") == "json";
+  ChunkWriter writer(*pEspSetup);
+  writer.begin(200, json ? "application/json" : "text/csv");
+  pLogger->Query(writer, from, to, json);
+  writer.end();
+}
+
+////////////////////////////////
+// Route table
+
+struct EspSetup::Route
+{
+  char       path[28];
+  HTTPMethod method;
+  void     (*pHandler)();
+  void     (*pUpload)();        // multipart upload data, nullptr if none
+};
+
+/*
+   Sorted by path (checked at compile time), routes with the same path are adjacent.
+   The whole table lives in flash, no handler object or std::function per route.
+*/
+constexpr EspSetup::Route EspSetup::routeTable[] PROGMEM = {
+  { "/all",                       HTTP_GET,    handleAll,        nullptr },
+  { "/canonical.html",            HTTP_GET,    handleCaptive,    nullptr },
+  { "/cmd/ESP-Reboot",            HTTP_GET,    handleReboot,     nullptr },
+  { "/connecttest.txt",           HTTP_GET,    handleCaptive,    nullptr },
+  { "/edit",                      HTTP_GET,    handleEditPage,   nullptr },             // load editor
+  { "/edit",                      HTTP_PUT,    handleFileCreate, nullptr },             // create file
+  { "/edit",                      HTTP_POST,   handleEditPost,   handleFileUpload },    // upload and chunk requests
+  { "/edit",                      HTTP_DELETE, handleFileDelete, nullptr },             // delete file
+  { "/events",                    HTTP_GET,    handleEvents,     nullptr },             // live console output as Server-Sent Events
+  { "/gen_204",                   HTTP_GET,    handleCaptive,    nullptr },
+  { "/generate_204",              HTTP_GET,    handleCaptive,    nullptr },
+  { "/hotspot-detect.html",       HTTP_GET,    handleCaptive,    nullptr },
+  { "/library/test/success.html", HTTP_GET,    handleCaptive,    nullptr },
+  { "/list",                      HTTP_GET,    handleFileList,   nullptr },             // list directory
+  { "/log",                       HTTP_GET,    handleLogQuery,   nullptr },             // data logger records
+  { "/ncsi.txt",                  HTTP_GET,    handleCaptive,    nullptr },
+  { "/redirect",                  HTTP_GET,    handleCaptive,    nullptr },
+  { "/setup",                     HTTP_GET,    handleSetupPage,  nullptr },
+  { "/status",                    HTTP_GET,    handleStatus,     nullptr },             // filesystem status
+  { "/success.txt",               HTTP_GET,    handleCaptive,    nullptr },
+  { "/update",                    HTTP_POST,   handleUpdate,     handleUpdateUpload },  // firmware / filesystem update
+};
+
+template <typename T, size_t N>
+static constexpr bool routesSorted(const T (&table)[N]) {
+  for (size_t i = 1; i < N; i++) {
+    const char *a = table[i - 1].path;
+    const char *b = table[i].path;
+    while (*a && *a == *b) { a++; b++; }
+    if ((uint8_t) *a > (uint8_t) *b) return false;
+  }
+  return true;
+}
+
+/*
+   One handler for all routes of the table, a request is looked up by binary search
+*/
+class RouteHandler : public RequestHandler
+{
+public:
+  bool canHandle(HTTPMethod method, const String &uri) override {
+    pRoute = find(method, uri.c_str());
+    // the captive portal probes are routes in AP mode only, otherwise the paths are
+    // left to the routes of esp.on() and the filesystem
+    if (pRoute && !pEspSetup->isApMode && pgm_read_ptr(&pRoute->pHandler) == (const void*) EspSetup::handleCaptive) {
+      pRoute = nullptr;
+    }
+    return pRoute != nullptr;
+  }
+  bool canUpload(const String &uri) override {
+    return pRoute && pgm_read_ptr(&pRoute->pUpload) && canHandle(HTTP_POST, uri);
+  }
+  bool handle(ESP8266WebServer &server, HTTPMethod method, const String &uri) override {
+    if (!canHandle(method, uri)) return false;
+    ((void (*)()) pgm_read_ptr(&pRoute->pHandler))();
+    return true;
+  }
+  void upload(ESP8266WebServer &server, const String &uri, HTTPUpload &upload) override {
+    if (canUpload(uri)) {
+      ((void (*)()) pgm_read_ptr(&pRoute->pUpload))();
+    }
+  }
+
+private:
+  static constexpr int count = sizeof(EspSetup::routeTable) / sizeof(EspSetup::routeTable[0]);
+
+  static const EspSetup::Route* find(HTTPMethod method, const char *pUri) {
+    int lo = 0, hi = count - 1;
+    while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      int cmp = strcmp_P(pUri, EspSetup::routeTable[mid].path);
+      if (cmp < 0) {
+        hi = mid - 1;
+      } else if (cmp > 0) {
+        lo = mid + 1;
+      } else {
+        while (mid > 0 && !strcmp_P(pUri, EspSetup::routeTable[mid - 1].path)) mid--;   // first route of this path
+        for (; mid < count && !strcmp_P(pUri, EspSetup::routeTable[mid].path); mid++) {
+          if ((HTTPMethod) pgm_read_dword(&EspSetup::routeTable[mid].method) == method) return &EspSetup::routeTable[mid];
+        }
+        return nullptr;
+      }
+    }
+    return nullptr;
+  }
+
+  const EspSetup::Route *pRoute = nullptr;
+};
+
+/*
+   Registered as first handler, it is asked for every request before the request is
+   dispatched and never takes it. Used to count the requests of a persistent connection.
+*/
+class KeepAliveHandler : public RequestHandler
+{
+public:
+  bool canHandle(HTTPMethod method, const String &uri) override {
+    pEspSetup->KeepAliveRequest();
+    return false;
+  }
+};
+
 void EspSetup::Setup(void){
   console.println("\nbooting...\n");
 
@@ -472,6 +2221,8 @@ void EspSetup::Setup(void){
   EspFileSytem->setConfig(EspFileSytemConfig);
   fsOK = EspFileSytem->begin();
   console.println(fsOK ? F("Filesystem initialized.") : F("Filesystem init failed!"));
+  refreshAssetOverrides();
+  if (fsOK) chunkCleanup(true);
 
   LoadNetworkConfiguration();
 #ifdef DEBUG_VERBOSE
@@ -493,20 +2244,8 @@ void EspSetup::Setup(void){
     }
   }
   
-  if (udpPort != 0) {
-    pUdp = new WiFiUDP();
-    pUdp->begin(udpPort);
-    console.print("UDP server started on port: ");
-    console.println(udpPort);
-  }
-
-  if (tcpPort != 0) {
-    pTcp = new WiFiServer(tcpPort);
-    pTcp->begin();
-    pTcp->setNoDelay(true);
-    console.print("TCP server started on port: ");
-    console.println(tcpPort);
-  }
+  UdpSetup();
+  TcpSetup();
 
   if (IsNTP()) {
     ntp.Setup(ntpHost, gmtOffs);
@@ -521,58 +2260,21 @@ void EspSetup::Setup(void){
   }
 
   // SERVER INIT
-  // filesystem status
-  on("/status", HTTP_GET, handleStatus);
-  // list directory
-  on("/list", HTTP_GET, handleFileList);
-  // load editor
-  on("/edit", HTTP_GET, [this]() {
-    if (CheckWebServerCredentials()) {
-      if (!handleFileRead(F("/esp/edit.htm"))) {
-        replyNotFound(FPSTR(FILE_NOT_FOUND));;
-      }
-    }
-  });
-  // create file
-  on("/edit", HTTP_PUT, handleFileCreate);
-  //delete file
-  on("/edit", HTTP_DELETE, handleFileDelete);
-  //first callback is called after the request has ended with all parsed arguments
-  //second callback handles file uploads at that location
-  on("/edit", HTTP_POST, [this]() {
-    send(200, "text/plain", "");
-  }, handleFileUpload);
-
-  on("/setup", HTTP_GET, [this]() {
-     // return WiFi setup page (setup.htm)
-	if (CheckWebServerCredentials()) {
-      if (!handleFileRead(F("/esp/setup.htm"))) {
-        replyNotFound(FPSTR(FILE_NOT_FOUND));;
-      }
-    }
-  });
-
-  // editor reset
-  on("/cmd/ESP-Reboot", HTTP_GET, [this]() {
-    replyNotFound(FPSTR(FILE_NOT_FOUND));
-    delay(100);
-    ESP.reset();
-  });
-
-  //get heap status, analog input value and all GPIO statuses in one json call
-  on("/all", HTTP_GET, [this]() {
-    String json = "{";
-    json += "\"heap\":" + String(ESP.getFreeHeap());
-    json += ", \"analog\":" + String(analogRead(A0));
-    json += ", \"gpio\":" + String((uint32_t)(((GPI | GPO) & 0xFFFF) | ((GP16I & 0x01) << 16)));
-    json += "}";
-    send(200, "text/json", json);
-    json = String();
-  });
+  // has to be the first handler, it sees every request
+  addHandler(new KeepAliveHandler());
+  // request headers evaluated by the handlers, all others are dropped by the web server
+  collectHeaders(requestHeaders, sizeof(requestHeaders) / sizeof(requestHeaders[0]));
+  // core routes (/status, /list, /edit, /setup, /update ...) from the table in flash,
+  // tried before the routes added by on()
+  static_assert(routesSorted(routeTable), "EspSetup::routeTable has to be sorted by path");
+  addHandler(new RouteHandler());
 
   //called when the url is not defined here
   //use it to load content from SPIFFS
   onNotFound([this]() {
+    if (captiveRedirect()) {
+      return;
+    }
     if (!handleFileRead(uri())) {
       String message = "File Not Found\n";
       message += "\nuri: ";
@@ -599,102 +2301,402 @@ void EspSetup::Setup(void){
   // start webSocket server
   EspWebSocket.begin();
   EspWebSocket.onEvent(EspWebSocketCallback);
+  EspWebSocket.onValidateHttpHeader(EspWebSocketHeader, nullptr, 0);
   AddWebSocketCallback(EspWebSocketEvent);
   console.println("WebSocket server started");
 
-  OTASetup();
+  OTASetup();
+}
+
+void EspSetup::Loop(void) {
+  if (!isApMode && !wifiConnectMillis && WiFi.status() != WL_CONNECTED) WiFi.reconnect();
+  ArduinoOTA.handle();
+  handleClient();
+  KeepAliveLoop();
+  if (otaReboot && millis() - otaReboot > 500) {
+    // give the last response and progress message time to be sent
+    ESP.restart();
+  }
+  MDNS.update();
+  EspWebSocket.loop();
+  TcpLoop();
+  UdpLoop();
+  DnsLoop();
+  mqtt.Loop();
+  scan.Loop();
+  for (DataLogger *pLogger : LoggerList) {
+    pLogger->Loop();
+  }
+  httpStreamLoop();
+  EventLoop();
+  NtpLoop();
+  ApplyLoop();
+}
+
+/*
+   HTTP/1.1 clients keep the connection for the next request (the burst of /edit or
+   /setup saves a TCP handshake per request) up to keepAliveMax requests.
+*/
+void EspSetup::KeepAliveRequest()
+{
+  WiFiClient &rClient = client();
+  if (keepAliveCount > 0 && rClient.remotePort() == keepAlivePort && rClient.remoteIP() == keepAliveIP) {
+    keepAliveCount++;
+  } else {
+    keepAliveCount = 1;
+    keepAliveIP = rClient.remoteIP();
+    keepAlivePort = rClient.remotePort();
+  }
+  keepAliveMillis = millis();
+  sessionIssued = false;
+  keepAlive(keepAliveTimeout > 0 && keepAliveCount < keepAliveMax);
+}
+
+/*
+   The connection now belongs to an /events or stream slot. Its WiFiClient copy shares
+   the ClientContext, so KeepAliveLoop() must not stop() it.
+*/
+void EspSetup::KeepAliveRelease()
+{
+  keepAliveCount = 0;
+  keepAlivePort = 0;
+  keepAlive(false);
+}
+
+/*
+   The web server waits several seconds for the next request on a persistent
+   connection, close it after keepAliveTimeout instead
+*/
+void EspSetup::KeepAliveLoop()
+{
+  if (keepAliveCount == 0 || millis() - keepAliveMillis <= keepAliveTimeout) return;
+  WiFiClient &rClient = client();
+  if (rClient.connected() && !rClient.available() && rClient.remotePort() == keepAlivePort && rClient.remoteIP() == keepAliveIP) {
+    rClient.stop();
+  }
+  keepAliveCount = 0;
+}
+
+void EspSetup::AddLogger(DataLogger &rLogger)
+{
+  LoggerList.push_back(&rLogger);
+  rLogger.Begin(EspFileSytem);
+}
+
+void EspSetup::DeepSleep(uint32_t msDelay)
+{
+  if (dsEnab) {
+    // RAM is lost in deep sleep
+    for (DataLogger *pLogger : LoggerList) {
+      pLogger->Flush();
+    }
+    delay(msDelay);
+    console.println("\nGoing to deep sleep...");
+    uint64_t uptime = micros();
+    uint64_t sleeptime = dsLoop * 1000;
+    // substract current uptime to achieve more accurate loop time
+    if (sleeptime > uptime) sleeptime -= uptime; 
+    ESP.deepSleep(sleeptime);
+    delay(0);
+  }
+}
+
+void EspSetup::NtpLoop()
+{
+  if (IsNTP()) {
+    ntp.Loop();
+  }
+}
+
+/*
+   (Re)starts the UDP server on udpPort, called by Setup() and when udpPort changes
+*/
+void EspSetup::UdpSetup()
+{
+  if (pUdp) {
+    pUdp->stop();
+    delete pUdp;
+    pUdp = nullptr;
+    udpSendCount = 0;
+  }
+  if (udpPort != 0) {
+    pUdp = new WiFiUDP();
+    pUdp->begin(udpPort);
+    console.print("UDP server started on port: ");
+    console.println(udpPort);
+  }
+}
+
+/*
+   (Re)starts the server on tcpPort, the service on it (telnet console or the one of
+   AddTcpService()) closes its sessions and is moved to the new server
+*/
+void EspSetup::TcpSetup()
+{
+  if (pTcpPortService) pTcpPortService->end();
+  if (pTcp) {
+    pTcp->stop();
+    delete pTcp;
+    pTcp = nullptr;
+  }
+  if (tcpPort != 0) {
+    pTcp = new WiFiServer(tcpPort);
+    pTcp->begin();
+    pTcp->setNoDelay(true);
+    if (!pTcpPortService) TelnetSetup();
+    pTcpPortService->begin(pTcp);
+    console.print("TCP server started on port: ");
+    console.println(tcpPort);
+  }
+}
+
+/*
+   The packet pools are allocated on first use, a sketch that uses the UDP socket on
+   its own (UDP()) does not pay for them
+*/
+void EspSetup::AddUdpCallback(UdpCallbackFn pFunction)
+{
+  if (!pUdpRecv) pUdpRecv = new UdpPacket[UDP_POOL_COUNT];
+  UdpCallbackList.push_back(pFunction);
+}
+
+/*
+   Datagrams are drained into the preallocated pool first and dispatched afterwards,
+   so a burst is taken off the socket before the callbacks spend time on it. Replies
+   queued by the callbacks are sent together at the end. Without callbacks the socket
+   is left to the sketch (UDP()).
+*/
+void EspSetup::UdpLoop()
+{
+  if (!pUdp || !pUdpRecv || UdpCallbackList.empty()) return;
+
+  int count = 0;
+  int size;
+  while (count < UDP_POOL_COUNT && (size = pUdp->parsePacket()) > 0) {
+    UdpPacket &packet = pUdpRecv[count++];
+    packet.remoteIP = pUdp->remoteIP();
+    packet.remotePort = pUdp->remotePort();
+    int len = pUdp->read(packet.data, UDP_PACKET_SIZE);
+    packet.length = (len > 0) ? len : 0;
+    if (size > UDP_PACKET_SIZE) udpTruncated++;
+  }
+  udpReceived += count;
+
+  for (int i = 0; i < count; i++) {
+    for (UdpCallbackFn &UdpCbFn : UdpCallbackList) {
+      UdpCbFn(pUdpRecv[i]);
+    }
+  }
+  UdpFlush();
 }
 
-void EspSetup::Loop(void) {
-  if (WiFi.status() != WL_CONNECTED ) WiFi.reconnect();
-  ArduinoOTA.handle();
-  handleClient();
-  MDNS.update();
-  EspWebSocket.loop();
-  TcpLoop();
-  NtpLoop();
+/*
+   Turns a DNS query into its answer in place and returns the answer length, 0 if the
+   message is no query. An A query of the first question is answered with ip, other
+   types get an empty answer. Further questions and EDNS records are dropped.
+*/
+static int dnsAnswer(uint8_t *pMsg, int len, const IPAddress &ip)
+{
+  if (len < 12 || (pMsg[2] & 0xF8) != 0 || ((pMsg[4] << 8) | pMsg[5]) == 0) {
+    return 0;                                   // response, not a standard query or no question
+  }
+  int pos = 12;
+  while (pos < len && pMsg[pos] != 0) {
+    if (pMsg[pos] & 0xC0) return 0;             // questions are not compressed
+    pos += pMsg[pos] + 1;
+  }
+  pos += 5;                                     // end of name, type, class
+  if (pos > len) {
+    return 0;
+  }
+  uint16_t type = (pMsg[pos - 4] << 8) | pMsg[pos - 3];
+  uint16_t cls = (pMsg[pos - 2] << 8) | pMsg[pos - 1];
+  bool answer = (type == 1 || type == 255) && cls == 1;   // A or ANY, IN
+  pMsg[2] = 0x84 | (pMsg[2] & 0x01);            // response, authoritative, keep RD
+  pMsg[3] = 0x80;                               // recursion available, no error
+  pMsg[4] = 0; pMsg[5] = 1;
+  pMsg[6] = 0; pMsg[7] = answer ? 1 : 0;
+  memset(&pMsg[8], 0, 4);
+  if (answer) {
+    const uint8_t record[] = { 0xC0, 0x0C, 0, 1, 0, 1, 0, 0, 0, DNS_TTL, 0, 4, ip[0], ip[1], ip[2], ip[3] };
+    memcpy(&pMsg[pos], record, sizeof(record));
+    pos += sizeof(record);
+  }
+  return pos;
 }
 
-void EspSetup::DeepSleep(uint32_t msDelay)
+// captive portal in AP mode, every host name resolves to the AP
+void EspSetup::DnsSetup(bool enable)
 {
-  if (dsEnab) {
-    delay(msDelay);
-    console.println("\nGoing to deep sleep...");
-    uint64_t uptime = micros();
-    uint64_t sleeptime = dsLoop * 1000;
-    // substract current uptime to achieve more accurate loop time
-    if (sleeptime > uptime) sleeptime -= uptime; 
-    ESP.deepSleep(sleeptime);
-    delay(0);
+  if (enable) {
+    if (!pDns) pDns = new WiFiUDP();
+    pDns->begin(DNS_PORT);
+  } else if (pDns) {
+    pDns->stop();
+    delete pDns;
+    pDns = nullptr;
   }
 }
 
-void EspSetup::NtpLoop()
+/*
+   Captive portal DNS in AP mode. Every host name resolves to the AP, so the connectivity
+   checks of phones and laptops reach the web server and the OS opens the setup page.
+   At most DNS_LOOP_MAX queries per Loop() and DNS_RATE_MAX per second are answered,
+   the rest is dropped (clients repeat them), a probe storm can't starve handleClient().
+   The message is handled in a pooled response buffer, nothing is allocated.
+*/
+void EspSetup::DnsLoop()
 {
-  if (IsNTP()) {
-    ntp.Loop();
+  if (!pDns) return;
+  for (int n = 0; n < DNS_LOOP_MAX; n++) {
+    int size = pDns->parsePacket();             // drops what is left of the previous one
+    if (size <= 0) return;
+    if (millis() - dnsWindow >= 1000) {
+      dnsWindow = millis();
+      dnsCount = 0;
+    }
+    if (++dnsCount > DNS_RATE_MAX || size > DNS_PACKET_SIZE) {
+      dnsDropped++;
+      continue;
+    }
+    uint8_t *pBuf = (uint8_t*) ChunkWriter::AcquireBuffer();
+    if (!pBuf) {
+      dnsDropped++;
+      return;
+    }
+    int len = dnsAnswer(pBuf, pDns->read(pBuf, DNS_PACKET_SIZE), WiFi.softAPIP());
+    if (len > 0) {
+      pDns->beginPacket(pDns->remoteIP(), pDns->remotePort());
+      pDns->write(pBuf, len);
+      pDns->endPacket();
+      dnsAnswered++;
+    }
+    ChunkWriter::ReleaseBuffer((char*) pBuf);
   }
 }
 
-void EspSetup::TcpLoop()
+bool EspSetup::UdpSend(const IPAddress &ip, uint16_t port, const uint8_t *pData, size_t len)
 {
-  if (!TCP()) return;
+  if (!pUdp) return false;
+  if (len > UDP_PACKET_SIZE) {
+    // too large for a queue buffer, keep the order and send it directly
+    UdpFlush();
+    return pUdp->beginPacket(ip, port) && pUdp->write(pData, len) == len && pUdp->endPacket();
+  }
+  if (!pUdpSend) pUdpSend = new UdpPacket[UDP_SEND_COUNT];
+  if (udpSendCount == UDP_SEND_COUNT) {
+    UdpFlush();
+  }
+  UdpPacket &packet = pUdpSend[udpSendCount++];
+  packet.remoteIP = ip;
+  packet.remotePort = port;
+  packet.length = len;
+  memcpy(packet.data, pData, len);
+  return true;
+}
 
-  // Cleanup disconnected session
-  for(int i = 0; i < MAX_TELNET_CLIENTS; i++) {
-    if (TelnetClient[i] && !TelnetClient[i].connected()) {
-      console.print("Client disconnected ... terminate session "); console.println(i+1); 
-      TelnetClient[i].stop();
+void EspSetup::UdpFlush()
+{
+  for (int i = 0; i < udpSendCount; i++) {
+    UdpPacket &packet = pUdpSend[i];
+    if (pUdp->beginPacket(packet.remoteIP, packet.remotePort)) {
+      pUdp->write(packet.data, packet.length);
+      pUdp->endPacket();
     }
   }
+  udpSendCount = 0;
+}
 
-  // Check new client connections
-  if (TCP()->hasClient()) {
-    bool ConnectionEstablished = false;
-
-    for(int i = 0; i < MAX_TELNET_CLIENTS; i++) {
-      // find free socket
-      if (!TelnetClient[i]) {
-        Telnet = TCP()->available();  // last connected socket is used as console output
-        while(Telnet.available()) Telnet.read();
-        Telnet.flush();               // clear input buffer, else you get strange characters
-        TelnetClient[i] = Telnet;
+void EspSetup::TcpLoop()
+{
+  for (TcpService *pService : TcpServiceList) {
+    pService->loop();
+  }
+}
 
-        console.print("New Telnet client connected to session "); console.println(i+1);
+void EspSetup::AddTcpService(TcpService &rService, uint16_t port)
+{
+  TcpServiceList.push_back(&rService);
+  if (port != 0) {
+    rService.begin(port);
+    return;
+  }
+  if (pTelnetService) {
+    // the telnet console gives way to the application service
+    pTelnetService->end();
+    TcpServiceList.erase(std::find(TcpServiceList.begin(), TcpServiceList.end(), pTelnetService));
+    delete pTelnetService;
+    pTelnetService = nullptr;
+  }
+  pTcpPortService = &rService;
+  if (pTcp) rService.begin(pTcp);
+}
 
-        TelnetClient[i].println("Welcome!");
-        TelnetClient[i].print("Millis since start: ");
-        TelnetClient[i].println(millis());
-        TelnetClient[i].print("Free Heap RAM: ");
-        TelnetClient[i].println(ESP.getFreeHeap());
-        TelnetClient[i].println("----------------------------------------------------------------");
+/*
+   Removes the telnet option negotiation (IAC sequences) of the client from its input,
+   a sequence may be split over several reads. The parser state is kept in pState.
+*/
+enum TelnetState { TN_DATA, TN_IAC, TN_OPTION, TN_SB, TN_SB_IAC };
 
-        ConnectionEstablished = true; 
+static void telnetFilter(TcpConnection &rConn, const uint8_t *pData, size_t len, String &rInput)
+{
+  TelnetState state = (TelnetState) (intptr_t) rConn.pState;
+  rInput.reserve(len);
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = pData[i];
+    switch (state) {
+      case TN_DATA:
+        if (c == 255) state = TN_IAC;
+        else rInput += (char) c;
+        break;
+      case TN_IAC:
+        if (c == 255) { rInput += (char) c; state = TN_DATA; }   // escaped 0xFF
+        else if (c >= 251) state = TN_OPTION;                    // WILL, WONT, DO, DONT <option>
+        else if (c == 250) state = TN_SB;                        // subnegotiation until IAC SE
+        else state = TN_DATA;                                    // two byte command
+        break;
+      case TN_OPTION:
+        state = TN_DATA;
+        break;
+      case TN_SB:
+        if (c == 255) state = TN_SB_IAC;
+        break;
+      case TN_SB_IAC:
+        state = (c == 240) ? TN_DATA : TN_SB;
         break;
-      }
-    }
-
-    if (ConnectionEstablished == false) {
-      console.println("No free sessions ... drop connection");
-      TCP()->available().stop();
     }
   }
+  rConn.pState = (void*) (intptr_t) state;
+}
 
-  for(int i = 0; i < MAX_TELNET_CLIENTS; i++) {
-    if (TelnetClient[i] && TelnetClient[i].connected()) {
-      if(TelnetClient[i].available()) { 
-        //get data from the telnet client
-        String input;
-        while(TelnetClient[i].available()) {
-          char c = TelnetClient[i].read();
-          input += c;
-        }
-        if (pTelnetCallbackFn) {
-          pTelnetCallbackFn(input);
-        }
+/*
+   Default service on tcpPort: a telnet console, the last connected session is used
+   as console output (Telnet), input is passed to the TelnetCallback.
+*/
+void EspSetup::TelnetSetup()
+{
+  pTelnetService = new TcpService(TcpFraming::Raw(),
+    [this](TcpConnection &rConn, const uint8_t *pData, size_t len) {
+      String input;
+      telnetFilter(rConn, pData, len, input);
+      if (pTelnetCallbackFn && input.length() > 0) {
+        pTelnetCallbackFn(input);
       }
-    }
-  }
+    },
+    [](TcpConnection &rConn) {
+      rConn.pState = (void*) (intptr_t) TN_DATA;
+      Telnet = rConn.Client();
+      rConn.println("Welcome!");
+      rConn.print("Millis since start: ");
+      rConn.println(millis());
+      rConn.print("Free Heap RAM: ");
+      rConn.println(ESP.getFreeHeap());
+      rConn.println("----------------------------------------------------------------");
+      return true;
+    },
+    nullptr, MAX_TELNET_CLIENTS);
+  TcpServiceList.push_back(pTelnetService);
+  pTcpPortService = pTelnetService;
 }
 
 String EspSetup::formatBytes(size_t bytes) {
@@ -709,37 +2711,72 @@ String EspSetup::formatBytes(size_t bytes) {
   }
 }
 
-String EspSetup::GetContentType(String filename) {
+/*
+   Content types by file extension, sorted by extension for the binary search.
+   Fixed width entries keep the whole table in flash without pointer indirection.
+*/
+struct MimeEntry
+{
+  char ext[8];
+  char type[32];
+};
+
+static const MimeEntry mimeTable[] PROGMEM = {
+  { "bin",   "application/octet-stream" },
+  { "css",   "text/css" },
+  { "csv",   "text/csv" },
+  { "gif",   "image/gif" },
+  { "gz",    "application/x-gzip" },
+  { "htm",   "text/html" },
+  { "html",  "text/html" },
+  { "ico",   "image/x-icon" },
+  { "jpeg",  "image/jpeg" },
+  { "jpg",   "image/jpeg" },
+  { "js",    "application/javascript" },
+  { "json",  "application/json" },
+  { "mjs",   "application/javascript" },
+  { "pdf",   "application/pdf" },
+  { "png",   "image/png" },
+  { "svg",   "image/svg+xml" },
+  { "ttf",   "font/ttf" },
+  { "txt",   "text/plain" },
+  { "wasm",  "application/wasm" },
+  { "webp",  "image/webp" },
+  { "woff",  "font/woff" },
+  { "woff2", "font/woff2" },
+  { "xml",   "text/xml" },
+  { "zip",   "application/zip" },
+};
+
+// custom types registered at runtime, checked before the built in table
+static std::vector<std::pair<const char*, const char*>> mimeCustom;
+
+void EspSetup::AddContentType(const char *ext, const char *type) {
+  if (ext && *ext == '.') ext++;
+  mimeCustom.push_back(std::make_pair(ext, type));
+}
+
+const __FlashStringHelper* EspSetup::GetContentType(const String &filename) {
   if (pEspSetup->hasArg("download")) {
-    return "application/octet-stream";
-  } else if (filename.endsWith(".htm")) {
-    return "text/html";
-  } else if (filename.endsWith(".html")) {
-    return "text/html";
-  } else if (filename.endsWith(".css")) {
-    return "text/css";
-  } else if (filename.endsWith(".js")) {
-    return "application/javascript";
-  } else if (filename.endsWith(".png")) {
-    return "image/png";
-  } else if (filename.endsWith(".gif")) {
-    return "image/gif";
-  } else if (filename.endsWith(".jpg")) {
-    return "image/jpeg";
-  } else if (filename.endsWith(".ico")) {
-    return "image/x-icon";
-  } else if (filename.endsWith(".xml")) {
-    return "text/xml";
-  } else if (filename.endsWith(".json")) {
-    return "text/json";
-  } else if (filename.endsWith(".pdf")) {
-    return "application/x-pdf";
-  } else if (filename.endsWith(".zip")) {
-    return "application/x-zip";
-  } else if (filename.endsWith(".gz")) {
-    return "application/x-gzip";
-  }
-  return "text/plain";
+    return FPSTR(mimeTable[0].type);   // application/octet-stream
+  }
+
+  int dot = filename.lastIndexOf('.');
+  if (dot >= 0 && dot > filename.lastIndexOf('/')) {
+    const char *ext = &filename.c_str()[dot + 1];
+    for (const auto &custom : mimeCustom) {
+      if (!strcasecmp(ext, custom.first)) return FPSTR(custom.second);
+    }
+    int lo = 0, hi = sizeof(mimeTable) / sizeof(mimeTable[0]) - 1;
+    while (lo <= hi) {
+      int mid = (lo + hi) / 2;
+      int cmp = strcasecmp_P(ext, mimeTable[mid].ext);
+      if (cmp == 0) return FPSTR(mimeTable[mid].type);
+      if (cmp < 0) hi = mid - 1;
+      else lo = mid + 1;
+    }
+  }
+  return FPSTR(TEXT_PLAIN);
 }
 
 String EspSetup::GetUniqueDeviceName()
@@ -769,10 +2806,27 @@ bool EspSetup::StartAPMode()
   WiFi.softAP(apName.c_str(), apPass.c_str(), apChan);
   isApMode = true;
 
+  DnsSetup(true);
+
   return true;
 }
 
 // Start STA Mode
+// static IP of wlSip4 or DHCP
+void EspSetup::ClientIpConfig()
+{
+  IPAddress ip, gw, mask, dns;
+  if (ip.fromString(wlSip4))
+  {
+    gw.fromString("192.168.0.1");
+    mask.fromString("255.255.255.0");
+    dns.fromString("192.168.0.1");
+    WiFi.config(ip, gw, mask, dns);
+  } else {
+    WiFi.config(IPAddress(), IPAddress(), IPAddress());
+  }
+}
+
 bool EspSetup::StartClientMode()
 {
   byte retries = 80;
@@ -787,19 +2841,22 @@ bool EspSetup::StartClientMode()
     delay(500);
   }
 #else
-  IPAddress ip, gw, mask, dns;  
-  if (ip.fromString(wlSip4))
-  {
-    gw.fromString("192.168.0.1");
-    mask.fromString("255.255.255.0");
-    dns.fromString("192.168.0.1");
-    WiFi.config(ip, gw, mask, dns);
-  }
+  ClientIpConfig();
 
-  if (String(WiFi.SSID()) != wlSsid) {
+  // several APs with this SSID: connect to the strongest one of a recent scan
+  const ScanResult *pBest = scan.Best(wlSsid);
+  if (pBest) {
+    console.printf("(BSSID %02X:%02X:%02X:%02X:%02X:%02X ch %u) ", pBest->bssid[0], pBest->bssid[1], pBest->bssid[2],
+                   pBest->bssid[3], pBest->bssid[4], pBest->bssid[5], pBest->channel);
+  }
+  if (String(WiFi.SSID()) != wlSsid || (pBest && WiFi.status() != WL_CONNECTED)) {
     WiFi.disconnect();
     WiFi.mode(WIFI_STA);
-    WiFi.begin(wlSsid.c_str(), wlPass.c_str());
+    if (pBest) {
+      WiFi.begin(wlSsid.c_str(), wlPass.c_str(), pBest->channel, pBest->bssid);
+    } else {
+      WiFi.begin(wlSsid.c_str(), wlPass.c_str());
+    }
     WiFi.persistent(true);
     WiFi.setAutoConnect(true);
     WiFi.setAutoReconnect(true);
@@ -824,6 +2881,7 @@ bool EspSetup::StartClientMode()
     }
   }
   isApMode = (retries <= 0);
+  if (!isApMode) DnsSetup(false);
 
   return !isApMode;
 }
@@ -838,8 +2896,14 @@ void EspSetup::OTASetup()
   // Hostname defaults to esp8266-[ChipID]
   // ArduinoOTA.setHostname("myesp8266");
 
-  // No authentication by default
-  // ArduinoOTA.setPassword((const char *)"1234");
+  if (hstName.length() > 0) {
+    ArduinoOTA.setHostname(hstName.c_str());
+  }
+
+  // No authentication by default, configured by otaPass of the network configuration
+  if (otaPass.length() > 0) {
+    ArduinoOTA.setPassword(otaPass.c_str());
+  }
   
   ArduinoOTA.onStart([this]() {
     console.println("Start");
@@ -850,7 +2914,7 @@ void EspSetup::OTASetup()
   });
   
   ArduinoOTA.onProgress([this](unsigned int progress, unsigned int total) {
-    console.printf("Progress: %u%%\r", (progress / (total / 100)));
+    console.printf("Progress: %u%%\r", total ? (unsigned int) ((uint64_t) progress * 100 / total) : 0);
   });
   ArduinoOTA.onError([this](ota_error_t error) {
     console.printf("Error[%u]: ", error);
@@ -865,10 +2929,18 @@ void EspSetup::OTASetup()
 }
 
 bool EspSetup::LoadNetworkConfiguration() {
-  String netconf;
-  bool ret = ReadFile(NETWORK_CONFIGURATION_PATH, netconf);
-  if (ret) {
-    ret = UpdateNetworkConfiguration(netconf.c_str());
+  // parse straight from the file, no intermediate String copy
+  StaticJsonDocument<1024> doc;
+  bool ret = ReadFile(NETWORK_CONFIGURATION_PATH, doc) && UpdateNetworkConfiguration(doc.as<JsonObject>());
+  if (!ret) {
+    // primary file is missing or truncated (e.g. power loss while saving),
+    // fall back to the last good generation and restore it
+    doc.clear();
+    ret = ReadFile(NETWORK_CONFIGURATION_PATH FILE_BAK_EXT, doc) && UpdateNetworkConfiguration(doc.as<JsonObject>());
+    if (ret) {
+      console.println("Network configuration recovered from backup");
+      WriteFile(NETWORK_CONFIGURATION_PATH, doc, true);
+    }
   }
   if (!ret) {
     console.println("Failed to load network configuration");
@@ -880,44 +2952,246 @@ bool EspSetup::LoadNetworkConfiguration() {
 }
 
 bool EspSetup::SaveNetworkConfiguration(char *pJson) {
-  WriteFile(NETWORK_CONFIGURATION_PATH, pJson);
-  return UpdateNetworkConfiguration(pJson);
+  StaticJsonDocument<1024> doc;
+  // validate before anything is committed to the filesystem
+  if (deserializeJson(doc, (const char*) pJson) || !doc.is<JsonObject>()) {
+    console.println("Invalid network configuration rejected");
+    return false;
+  }
+  // settings the services run with, ApplyLoop() restarts those that changed
+  String wifi = WifiSettings();
+  int    web = webPort, udp = udpPort, tcp = tcpPort, gmt = gmtOffs;
+  bool   ntpOn = ntpEnab;
+  String ntpUrl = ntpHost, host = hstName, user = webUser, pass = webPass, ota = otaPass;
+  // only a configuration that has been taken over is written
+  if (!UpdateNetworkConfiguration(doc.as<JsonObject>())) {
+    console.println("Invalid network configuration rejected");
+    return false;
+  }
+  // the taken over settings, the page leaves out the write-only otaPass unless it changed
+  doc.clear();
+  DumpNetworkConfiguration(doc);
+  doc.remove("otaSet");
+  doc.remove("mac");
+  doc["otaPass"] = otaPass;
+  if (!WriteFile(NETWORK_CONFIGURATION_PATH, doc, true)) {
+    console.println("Failed to save network configuration");
+    LoadNetworkConfiguration();                 // back to the saved settings
+    return false;
+  }
+  if (wifi != WifiSettings()) configChanges |= CFG_WIFI;
+  if (web != webPort) configChanges |= CFG_WEB;
+  if (udp != udpPort) configChanges |= CFG_UDP;
+  if (tcp != tcpPort) configChanges |= CFG_TCP;
+  if (ntpOn != ntpEnab || ntpUrl != ntpHost || gmt != gmtOffs) configChanges |= CFG_NTP;
+  if (host != hstName) configChanges |= CFG_MDNS;
+  if (user != webUser || pass != webPass) configChanges |= CFG_AUTH;
+  if (host != hstName || ota != otaPass) {
+    // ArduinoOTA takes host name and password once per boot, /update and WebSocket OTA
+    // use the new password right away
+    console.println("ArduinoOTA host name and password apply after the next reboot");
+  }
+  return true;
+}
+
+// the settings of a WiFi transition
+String EspSetup::WifiSettings()
+{
+  return String(apMode) + '\n' + wlSsid + '\n' + wlPass + '\n' + wlSip4 + '\n' + apName + '\n' + apPass + '\n' + apSip4 + '\n' + apChan;
+}
+
+/*
+   Takes over a saved network configuration without a reboot, only the services whose
+   settings changed are restarted. Called from Loop(), not from within the WebSocket
+   or HTTP handler that saved it. A changed WiFi mode, SSID, password or IP starts a
+   non-blocking transition: a new client connection is tried for WIFI_CONNECT_TIMEOUT
+   while the AP (if running) stays up, on failure the device falls back to AP mode.
+   Deep sleep settings are read when DeepSleep() is called and need no restart.
+*/
+void EspSetup::ApplyLoop()
+{
+  uint32_t changes = configChanges;
+  configChanges = 0;
+  if (changes & CFG_WIFI) {
+    WifiApply();
+  }
+  if (changes & CFG_WEB) {
+    if (webPort <= 0 || webPort > 65535) webPort = 80;
+    close();
+    begin(webPort);
+    console.print("HTTP server restarted on port: ");
+    console.println(webPort);
+  }
+  if (changes & CFG_UDP) {
+    UdpSetup();
+  }
+  if (changes & CFG_TCP) {
+    TcpSetup();
+  }
+  if ((changes & CFG_NTP) && IsNTP()) {
+    ntp.Setup(ntpHost, gmtOffs);
+    console.print("NTP client restarted on url: ");
+    console.println(ntpHost);
+  }
+  if (changes & CFG_MDNS) {
+    MDNS.end();
+    if (hstName.length() > 0) MDNS.begin(hstName);
+  }
+  if (changes & CFG_AUTH) {
+    sessionKeyValid = false;                    // new credentials end all sessions
+    // WebSocket clients were authorized by a cookie of the old key, they have to log in
+    // again; the disconnect event clears their bit in webSocketAuthMask
+    for (int num = 0; webSocketAuthMask && num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+      if (webSocketAuthMask & (1u << num)) {
+        EspWebSocket.disconnect(num);
+      }
+    }
+  }
+
+  if (!wifiConnectMillis) return;
+  if (WiFi.status() == WL_CONNECTED) {
+    wifiConnectMillis = 0;
+    console.print("WiFi connected IP: ");
+    console.println(WiFi.localIP());
+    if (isApMode) {
+      WiFi.softAPdisconnect(true);
+      WiFi.mode(WIFI_STA);
+      isApMode = false;
+      DnsSetup(false);
+    }
+    MDNS.end();
+    if (hstName.length() > 0) MDNS.begin(hstName);
+    if (IsNTP()) ntp.Setup(ntpHost, gmtOffs);
+  } else if (millis() - wifiConnectMillis > WIFI_CONNECT_TIMEOUT) {
+    wifiConnectMillis = 0;
+    console.println("WiFi connect failed ... AP mode");
+    StartAPMode();
+  }
+}
+
+/*
+   Starts the WiFi transition of a changed configuration, the connection is
+   watched by ApplyLoop()
+*/
+void EspSetup::WifiApply()
+{
+  if (apMode) {
+    wifiConnectMillis = 0;
+    StartAPMode();
+    return;
+  }
+  console.printf("Connecting to %s\n", wlSsid.c_str());
+  // keep the AP while connecting, the setup page stays reachable if it fails
+  WiFi.mode(isApMode ? WIFI_AP_STA : WIFI_STA);
+  ClientIpConfig();
+  const ScanResult *pBest = scan.Best(wlSsid);
+  if (pBest) {
+    WiFi.begin(wlSsid.c_str(), wlPass.c_str(), pBest->channel, pBest->bssid);
+  } else {
+    WiFi.begin(wlSsid.c_str(), wlPass.c_str());
+  }
+  wifiConnectMillis = millis() | 1;             // 0 means no transition
 }
 
 bool EspSetup::UpdateNetworkConfiguration(const char *pJson) {
-  bool ret = false;
   StaticJsonDocument<1024> doc;
   if (!deserializeJson(doc, pJson)) {
-    JsonObject obj = doc.as<JsonObject>();
-    apMode = obj["apMode"];
-    if (obj.containsKey("wlSsid")) wlSsid = obj["wlSsid"].as<String>();
-    if (obj.containsKey("wlPass")) wlPass = obj["wlPass"].as<String>();
-    if (obj.containsKey("wlSip4")) wlSip4 = obj["wlSip4"].as<String>();
-    if (obj.containsKey("apName")) apName = obj["apName"].as<String>();
-    if (obj.containsKey("apPass")) apPass = obj["apPass"].as<String>();
-    if (obj.containsKey("apSip4")) apSip4 = obj["apSip4"].as<String>();
-    apChan = obj["apChan"];
-    if (obj.containsKey("hstName")) hstName = obj["hstName"].as<String>();
-    webPort = obj["webPort"];
-    if (obj.containsKey("webUser")) webUser = obj["webUser"].as<String>();
-    if (obj.containsKey("webPass")) webPass = obj["webPass"].as<String>();
-    udpPort = obj["udpPort"];
-    tcpPort = obj["tcpPort"];
-    if (obj.containsKey("ntpEnab")) ntpEnab  = obj["ntpEnab"];
-    if (obj.containsKey("ntpHost")) ntpHost  = obj["ntpHost"].as<String>();
-    gmtOffs = obj["gmtOffs"];
-    if (obj.containsKey("dsEnab")) dsEnab = obj["dsEnab"];
-    dsLoop = obj["dsLoop"];
-
-    if (apName == "") apName = GetUniqueDeviceName();
-    ret = true;
+    return UpdateNetworkConfiguration(doc.as<JsonObject>());
   }
-  return ret;
+  return false;
+}
+
+/*
+   The setup page sends its number fields as strings, a saved file may hold either,
+   an empty field counts as 0. Absent keys keep rValue, fails on anything else than
+   a number within min..max.
+*/
+static bool configNumber(JsonObject obj, const char *key, long min, long max, long &rValue) {
+  JsonVariant v = obj[key];
+  if (v.isNull()) return true;
+  long value;
+  if (v.is<long>()) {
+    value = v.as<long>();
+  } else if (v.is<const char*>()) {
+    const char *pStr = v.as<const char*>();
+    char *pEnd;
+    value = strtol(pStr, &pEnd, 10);
+    if (*pEnd) return false;
+  } else {
+    return false;
+  }
+  if (value < min || value > max) return false;
+  rValue = value;
+  return true;
+}
+
+static bool configString(JsonObject obj, const char *key) {
+  return obj[key].isNull() || obj[key].is<const char*>();
+}
+
+/*
+   Everything is checked before anything is taken over, a rejected configuration
+   leaves the running settings untouched. apMode and webPort are mandatory.
+*/
+bool EspSetup::UpdateNetworkConfiguration(JsonObject obj) {
+  if (obj.isNull() || !obj["apMode"].is<bool>() || obj["webPort"].isNull()) return false;
+
+  static const char *const stringKeys[] = { "wlSsid", "wlPass", "wlSip4", "apName", "apPass", "apSip4",
+                                            "hstName", "webUser", "webPass", "ntpHost", "otaPass" };
+  for (const char *key : stringKeys) {
+    if (!configString(obj, key)) return false;
+  }
+  if (!(obj["ntpEnab"].isNull() || obj["ntpEnab"].is<bool>()) || !(obj["dsEnab"].isNull() || obj["dsEnab"].is<bool>())) return false;
+
+  long web = webPort, udp = udpPort, tcp = tcpPort, chan = apChan, gmt = gmtOffs, loop = dsLoop;
+  if (!configNumber(obj, "webPort", 1, 65535, web) ||
+      !configNumber(obj, "udpPort", 0, 65535, udp) ||        // 0 disables the service
+      !configNumber(obj, "tcpPort", 0, 65535, tcp) ||
+      !configNumber(obj, "apChan", 1, 13, chan) ||
+      !configNumber(obj, "gmtOffs", -12, 14, gmt) ||
+      !configNumber(obj, "dsLoop", 0, LONG_MAX, loop)) {
+    return false;
+  }
+  bool ap = obj["apMode"];
+  if (!ap && (obj["wlSsid"].isNull() ? wlSsid.isEmpty() : !*obj["wlSsid"].as<const char*>())) {
+    return false;                                 // client mode without a network to join
+  }
+
+  apMode = ap;
+  if (obj.containsKey("wlSsid")) wlSsid = obj["wlSsid"].as<String>();
+  if (obj.containsKey("wlPass")) wlPass = obj["wlPass"].as<String>();
+  if (obj.containsKey("wlSip4")) wlSip4 = obj["wlSip4"].as<String>();
+  if (obj.containsKey("apName")) apName = obj["apName"].as<String>();
+  if (obj.containsKey("apPass")) apPass = obj["apPass"].as<String>();
+  if (obj.containsKey("apSip4")) apSip4 = obj["apSip4"].as<String>();
+  apChan = chan;
+  if (obj.containsKey("hstName")) hstName = obj["hstName"].as<String>();
+  webPort = web;
+  if (obj.containsKey("webUser")) webUser = obj["webUser"].as<String>();
+  if (obj.containsKey("webPass")) webPass = obj["webPass"].as<String>();
+  udpPort = udp;
+  tcpPort = tcp;
+  if (obj.containsKey("ntpEnab")) ntpEnab  = obj["ntpEnab"];
+  if (obj.containsKey("ntpHost")) ntpHost  = obj["ntpHost"].as<String>();
+  gmtOffs = gmt;
+  if (obj.containsKey("dsEnab")) dsEnab = obj["dsEnab"];
+  dsLoop = loop;
+  if (obj.containsKey("otaPass")) otaPass = obj["otaPass"].as<String>();
+
+  if (apName == "") apName = GetUniqueDeviceName();
+  return true;
 }
 
 String EspSetup::DumpNetworkConfiguration() {
-  StaticJsonDocument<512> doc;
-  
+  StaticJsonDocument<768> doc;
+  DumpNetworkConfiguration(doc);
+
+  String conf;
+  serializeJson(doc, conf);
+  return conf;
+}
+
+void EspSetup::DumpNetworkConfiguration(JsonDocument &doc) {
   doc["apMode"]  = apMode;
   doc["wlSsid"]  = wlSsid;
   doc["wlPass"]  = wlPass;
@@ -937,11 +3211,8 @@ String EspSetup::DumpNetworkConfiguration() {
   doc["gmtOffs"] = gmtOffs;
   doc["dsEnab"]  = dsEnab;
   doc["dsLoop"]  = dsLoop;
+  doc["otaSet"]  = !otaPass.isEmpty();       // the password itself is write-only
   doc["mac"] = WiFi.macAddress();
-
-  String conf;
-  serializeJson(doc, conf);
-  return conf;
 }
 
 bool EspSetup::WebSocketConnected() {
@@ -956,59 +3227,234 @@ void EspSetup::WebSocketBroadcast(String text) {
   EspWebSocket.broadcastTXT(text.c_str()); 
 }
 
-bool EspSetup::WriteFile(const String &rFilePath, const String &rData) {
+/*
+   Serializes doc into a pooled buffer, MessagePack or JSON text. Returns the length,
+   0 if it does not fit into RESPONSE_BUFFER_SIZE.
+*/
+static size_t webSocketEncode(const JsonDocument &doc, bool binary, char *pBuf) {
+  size_t len = binary ? measureMsgPack(doc) : measureJson(doc);
+  if (len >= RESPONSE_BUFFER_SIZE) return 0;
+  return binary ? serializeMsgPack(doc, pBuf, RESPONSE_BUFFER_SIZE) : serializeJson(doc, pBuf, RESPONSE_BUFFER_SIZE);
+}
+
+/*
+   MessagePack is about a third smaller than the JSON text for numeric telemetry and is
+   written straight from the document, no String is built. Documents larger than a
+   pooled buffer are sent as text the String way.
+*/
+bool EspSetup::WebSocketSendJson(int num, const JsonDocument &doc) {
+  bool binary = webSocketBinaryMask & (1u << num);
+  char *pBuf = ChunkWriter::AcquireBuffer();
+  size_t len = pBuf ? webSocketEncode(doc, binary, pBuf) : 0;
+  bool ok;
+  if (len > 0) {
+    ok = binary ? EspWebSocket.sendBIN(num, (const uint8_t*) pBuf, len) : EspWebSocket.sendTXT(num, pBuf, len);
+  } else {
+    String text;
+    serializeJson(doc, text);
+    ok = EspWebSocket.sendTXT(num, text);
+  }
+  if (pBuf) ChunkWriter::ReleaseBuffer(pBuf);
+  return ok;
+}
+
+void EspSetup::WebSocketBroadcastJson(const JsonDocument &doc) {
+  for (int pass = 0; pass < 2; pass++) {
+    bool binary = (pass == 0);
+    uint32_t mask = webSocketAuthMask & (binary ? webSocketBinaryMask : ~webSocketBinaryMask);
+    if (!mask) continue;
+    char *pBuf = ChunkWriter::AcquireBuffer();
+    size_t len = pBuf ? webSocketEncode(doc, binary, pBuf) : 0;
+    for (int num = 0; num < WEBSOCKETS_SERVER_CLIENT_MAX; num++) {
+      if (!(mask & (1u << num))) continue;
+      if (len == 0) WebSocketSendJson(num, doc);
+      else if (binary) EspWebSocket.sendBIN(num, (const uint8_t*) pBuf, len);
+      else EspWebSocket.sendTXT(num, pBuf, len);
+    }
+    if (pBuf) ChunkWriter::ReleaseBuffer(pBuf);
+  }
+}
+
+/*
+   Atomically replace rFilePath by the already written and synced rFilePath.tmp.
+   With keepBackup the previous content is kept as rFilePath.bak, for files whose
+   loader falls back to it (network configuration, device registry). Other files
+   are replaced by the rename alone and don't pay a second copy in flash.
+*/
+bool EspSetup::CommitFile(const String &rFilePath, bool keepBackup) {
+  String tmp = rFilePath + FILE_TMP_EXT;
+  String bak = rFilePath + FILE_BAK_EXT;
+  if (!keepBackup) {
+    if (EspFileSytem->exists(bak)) EspFileSytem->remove(bak);   // left by an older version
+    return replaceFile(tmp, rFilePath);
+  }
+  if (EspFileSytem->exists(rFilePath)) {
+    if (EspFileSytem->exists(bak)) EspFileSytem->remove(bak);
+    if (!EspFileSytem->rename(rFilePath, bak)) {
+      EspFileSytem->remove(tmp);
+      return false;
+    }
+  }
+  return EspFileSytem->rename(tmp, rFilePath);
+}
+
+bool EspSetup::WriteFile(const String &rFilePath, const String &rData, bool keepBackup) {
   bool ret = false;
   if (EspFileSytem) {
-    File file = EspFileSytem->open(rFilePath, "w");
+    String tmp = rFilePath + FILE_TMP_EXT;
+    File file = EspFileSytem->open(tmp, "w");
     if(file)
     {
-      ret = file.write(rData.c_str()) == rData.length();
+      ret = file.write((const uint8_t*) rData.c_str(), rData.length()) == rData.length();
+      file.flush();   // sync data and metadata to flash before the rename
       file.close();
+      if (ret) ret = CommitFile(rFilePath, keepBackup);
+      else EspFileSytem->remove(tmp);
     }
   }
   return ret;
 }
 
-bool EspSetup::WriteFile(const String &rFilePath, const JsonDocument &rDoc) {
+bool EspSetup::WriteFile(const String &rFilePath, const JsonDocument &rDoc, bool keepBackup) {
   bool ret = false;
   if (EspFileSytem) {
-    File file = EspFileSytem->open(rFilePath, "w");
+    String tmp = rFilePath + FILE_TMP_EXT;
+    File file = EspFileSytem->open(tmp, "w");
     if(file)
     {
       ret = serializeJsonPretty(rDoc, file) > 0;
+      file.flush();   // sync data and metadata to flash before the rename
       file.close();
+      if (ret) ret = CommitFile(rFilePath, keepBackup);
+      else EspFileSytem->remove(tmp);
     }
   }
   return ret;
 }
 
+/*
+   Stream adapter reading a File in fixed size chunks. ArduinoJson pulls its
+   input one character at a time, this keeps those reads out of the filesystem.
+*/
+class BufferedFileReader : public Stream
+{
+public:
+  BufferedFileReader(File &rFile) : file(rFile) {}
+
+  int available() override { return (len - pos) + file.available(); }
+  int read() override { return fill() ? buf[pos++] : -1; }
+  int peek() override { return fill() ? buf[pos] : -1; }
+  size_t write(uint8_t) override { return 0; }
+
+  size_t readBytes(char *pBuffer, size_t length) override {
+    size_t cnt = 0;
+    while (cnt < length && fill()) {
+      size_t n = std::min(length - cnt, len - pos);
+      memcpy(&pBuffer[cnt], &buf[pos], n);
+      pos += n;
+      cnt += n;
+    }
+    return cnt;
+  }
+
+private:
+  bool fill() {
+    if (pos >= len) {
+      len = file.read(buf, sizeof(buf));
+      pos = 0;
+    }
+    return pos < len;
+  }
+
+  File  &file;
+  uint8_t buf[FILE_READ_CHUNK_SIZE];
+  size_t pos = 0;
+  size_t len = 0;
+};
+
 bool EspSetup::ReadFile(const String &rFilePath, String &rData) {
   bool ret = false;
   if (EspFileSytem && EspFileSytem->exists(rFilePath)) {
     File file = EspFileSytem->open(rFilePath, "r");
     if(file)
     {
-      rData = file.readString();
+      // preallocate the exact size and copy in chunks instead of growing the String
+      size_t size = file.size();
+      rData.clear();
+      ret = rData.reserve(size);
+      char buf[FILE_READ_CHUNK_SIZE];
+      while (ret && size > 0) {
+        size_t len = file.read((uint8_t*) buf, std::min(size, sizeof(buf)));
+        if (len == 0) break;
+        ret = rData.concat(buf, len);
+        size -= len;
+      }
+      ret = ret && size == 0;
       file.close();
-      ret = true;
     }
   }
   return ret;  
 }
 
+bool EspSetup::ReadFile(const String &rFilePath, char *pBuffer, size_t size, size_t *pLength) {
+  bool ret = false;
+  if (pBuffer && size > 0 && EspFileSytem && EspFileSytem->exists(rFilePath)) {
+    File file = EspFileSytem->open(rFilePath, "r");
+    if(file)
+    {
+      size_t len = file.size();
+      // the content plus terminating zero has to fit into the caller's buffer
+      if (len < size) {
+        ret = file.read((uint8_t*) pBuffer, len) == len;
+      }
+      pBuffer[ret ? len : 0] = '\0';
+      if (pLength) *pLength = ret ? len : 0;
+      file.close();
+    }
+  }
+  return ret;
+}
+
 bool EspSetup::ReadFile(const String &rFilePath, JsonDocument &rDoc) {
   bool ret = false;
   if (EspFileSytem && EspFileSytem->exists(rFilePath)) {
     File file = EspFileSytem->open(rFilePath, "r");
     if(file)
     {
-      ret = file.size() > 0 && !deserializeJson(rDoc, file);
+      BufferedFileReader reader(file);
+      ret = file.size() > 0 && !deserializeJson(rDoc, reader);
+      file.close();
+    }
+  }
+  return ret;
+}
+
+bool EspSetup::ReadFile(const String &rFilePath, JsonDocument &rDoc, const JsonDocument &rFilter) {
+  bool ret = false;
+  if (EspFileSytem && EspFileSytem->exists(rFilePath)) {
+    File file = EspFileSytem->open(rFilePath, "r");
+    if(file)
+    {
+      // keys not present in the filter are skipped while parsing and never stored
+      BufferedFileReader reader(file);
+      ret = file.size() > 0 && !deserializeJson(rDoc, reader, DeserializationOption::Filter(rFilter));
       file.close();
     }
   }
   return ret;
 }
 
+bool EspSetup::VisitFile(const String &rFilePath, const JsonDocument &rFilter, JsonVisitorFn pFunction, size_t docSize) {
+  DynamicJsonDocument doc(docSize);
+  if (!pFunction || !ReadFile(rFilePath, doc, rFilter)) {
+    return false;
+  }
+  for (JsonPair kv : doc.as<JsonObject>()) {
+    pFunction(kv.key().c_str(), kv.value());
+  }
+  return true;
+}
+
 //=== class NTPClient ===
 
 #define NTP_INTERVAL 3600                 // updating intervall: 1 hour shoud be sufficient
@@ -1028,9 +3474,13 @@ NTPClient::~NTPClient() {
 bool NTPClient::Setup(String &rUrl, int gmt) {
   url = rUrl;
   setGmtOffset(gmt);
+  doSync = false;
+  nextRequest = 0;              // the next Loop() asks the (new) server, not the next hourly sync
   if (url.length() > 0) {
-    pUdp = new WiFiUDP();
-    pUdp->begin(NTP_LOCAL_PORT);
+    if (!pUdp) {                // called again when the configuration changes
+      pUdp = new WiFiUDP();
+      pUdp->begin(NTP_LOCAL_PORT);
+    }
     doSync = true;
   }
   return doSync;
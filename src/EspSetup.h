@@ -12,18 +12,74 @@
 #include <LittleFS.h>
 #include <ArduinoJson.h>
 #include <TimeLib.h>
+#include "EspTcp.h"
+#include "EspMqtt.h"
+#include "EspScan.h"
+#include "EspLogger.h"
 
 typedef std::function<void(uint8_t num, WStype_t type, uint8_t *payload, size_t len)> WebSocketServerEvent;
 typedef std::function<void(const String &txt)> TelnetCallbackFn;
+typedef std::function<void(const char *key, JsonVariant value)> JsonVisitorFn;
 
 #define NETWORK_CONFIGURATION_PATH "/esp/network.json"
-#define MAX_TELNET_CLIENTS 2
+#define FILE_TMP_EXT ".tmp"     // WriteFile() writes here first, then renames
+#define FILE_BAK_EXT ".bak"     // previous generation kept by WriteFile(.., true)
+#define FILE_READ_CHUNK_SIZE 128
+#define FILE_COPY_CHUNK_SIZE 512
+#define UPLOAD_BUFFER_SIZE 4096     // uploads are written to flash in blocks of this size (LittleFS block size)
+#define UPLOAD_CHUNK_DIR "/esp/upload"  // pending resumable uploads
+#define UPLOAD_CHUNK_MAX_AGE 86400  // s a resumable upload may stay pending, older ones are removed
+#define OTA_PROGRESS_STEP 5         // percent between progress broadcasts
+#define OTA_OWNER_NONE -1           // no OTA session
+#define OTA_OWNER_HTTP 255          // session started by POST /update, else the WebSocket client number
+#define RESPONSE_BUFFER_SIZE 1460   // TCP MSS, one full segment per HTTP chunk
+#define RESPONSE_BUFFER_COUNT 2     // pooled buffers shared by all handlers
+#define HTTP_KEEPALIVE_TIMEOUT 2000  // ms an idle persistent HTTP connection is kept open
+#define HTTP_KEEPALIVE_MAX 32        // requests per persistent HTTP connection
+#define AUTH_SESSION_TIME 3600        // s a session cookie issued after a successful login is valid
+#define AUTH_FAIL_SLOTS 4             // client IPs tracked for failed logins
+#define AUTH_FAIL_MAX 5               // failed logins before the client IP is blocked
+#define AUTH_BLOCK_TIME 30000         // ms a blocked client IP is answered by 429
+#define HTTP_STREAM_SLOTS 3          // ESPSETUP_ASYNC: file responses sent in the background
+#define HTTP_STREAM_TIMEOUT 10000    // ms without progress before a background response is dropped
+#define MAX_TELNET_CLIENTS 2         // sessions of the default tcpPort service (telnet console)
+#define MAX_EVENT_CLIENTS 2         // concurrent /events (Server-Sent Events) subscribers
+#define LOG_RING_SIZE 2048          // console output kept in RAM for /events and the WebSocket log
+#define LOG_LINE_MAX 160            // longer lines are split into several events
+#define UDP_PACKET_SIZE 512         // larger datagrams are truncated
+#define UDP_POOL_COUNT 8            // datagrams drained per Loop() into preallocated buffers
+#define UDP_SEND_COUNT 4            // queued replies, sent in one burst after the callbacks
+#define DNS_PORT 53                 // captive portal DNS, runs in AP mode only
+#define DNS_PACKET_SIZE 512         // larger queries are dropped
+#define DNS_TTL 60                  // s, short so clients ask again after leaving AP mode
+#define DNS_LOOP_MAX 2              // queries answered per Loop()
+#define DNS_RATE_MAX 20             // queries answered per second, the rest is dropped
+#define WIFI_CONNECT_TIMEOUT 15000  // ms a hot applied client configuration may take to connect before AP mode
 #define DEFAULT_APIP "192.168.4.1"
 #define DEFAULT_WLIP "DHCP"
 
 class WiFiUDP;
 class WiFiServer;
 
+// read-only web page linked into flash, generated by tools/mkassets.py
+struct EspAsset
+{
+  const char    *path;    // PROGMEM absolute path e.g. "/esp/setup.htm"
+  const uint8_t *data;    // PROGMEM gzip compressed content
+  uint32_t       size;    // compressed size in bytes
+};
+
+// datagram received on udpPort or queued for sending, buffers are preallocated
+struct UdpPacket
+{
+  IPAddress remoteIP;
+  uint16_t  remotePort;
+  uint16_t  length;
+  uint8_t   data[UDP_PACKET_SIZE];
+};
+
+typedef std::function<void(const UdpPacket &packet)> UdpCallbackFn;
+
 class NTPClient
 {
 public:
@@ -69,6 +125,59 @@ private:
   bool   sync = false;                                                    // true if synced with NTP server
 };
 
+// Console output tee. Everything printed is forwarded to the configured Stream
+// (Serial, Telnet or NoDebug) and kept in a RAM ring buffer for remote viewers.
+class ConsoleLog : public Stream
+{
+public:
+  ConsoleLog(Stream &rOut) : out(rOut) {}
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *pData, size_t size) override;
+  int  available() override { return out.available(); }
+  int  read() override { return out.read(); }
+  int  peek() override { return out.peek(); }
+  void flush() override { out.flush(); }
+  using Print::write;
+
+  uint32_t Head() const { return head; }                                  // position of the next byte logged
+  uint32_t Tail() const { return wrapped ? head - LOG_RING_SIZE : 0; }    // oldest position still available
+  bool     Lost(uint32_t pos) const { return head - pos > Head() - Tail(); } // pos has been overwritten already
+  int      ReadLine(uint32_t &rPos, char *pBuffer, size_t size) const;    // next complete line or -1, advances rPos
+
+private:
+  Stream  &out;
+  char     ring[LOG_RING_SIZE];
+  uint32_t head = 0;
+  bool     wrapped = false;
+};
+
+// Print sink for HTTP/1.1 chunked responses. Output is coalesced in a pooled
+// buffer and only sent when a full TCP segment is collected or on end().
+class ChunkWriter : public Print
+{
+public:
+  ChunkWriter(ESP8266WebServer &rServer) : server(rServer) {}
+  virtual ~ChunkWriter() { end(); }
+
+  bool begin(int code, const char *pContentType);   // HTTP/1.0 clients get an unframed response and the connection is closed
+  void end();                                       // flush pending data and finalize the response
+
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *pData, size_t size) override;
+  void   flush() override;
+  using Print::write;
+
+  static char* AcquireBuffer();                     // nullptr if all pooled buffers are in use
+  static void  ReleaseBuffer(char *pBuffer);
+
+private:
+  ESP8266WebServer &server;
+  char  *pBuf = nullptr;
+  size_t len = 0;
+  bool   active = false;
+};
+
 class EspSetup : public ESP8266WebServer
 {
   public:
@@ -77,6 +186,7 @@ class EspSetup : public ESP8266WebServer
 
   void Setup();
   void Loop();
+  Stream& Console() { return console; }   // prints go to the console and to the /events log
   void DeepSleep(uint32_t msDelay = 0);
   void OverideDeepSleepPin(int pin) { dsOveridePin = pin; } 
 
@@ -86,58 +196,143 @@ class EspSetup : public ESP8266WebServer
   WiFiUDP* UDP() { return pUdp; }
   WiFiServer* TCP() { return pTcp; }
   FS* GetFS();
-  bool CheckWebServerCredentials();
+  bool CheckWebServerCredentials();                                    // session cookie or Basic/Digest login, issues the cookie
+  bool CheckSessionCookie(const char *pCookie, const IPAddress &ip);   // true if no webUser/webPass is configured
+  bool WebServerAuthorized();                                          // CheckWebServerCredentials() without a reply
+  void KeepAlive(uint32_t timeout, int maxRequests) { keepAliveTimeout = timeout; keepAliveMax = maxRequests; }  // 0 disables persistent connections
+  void KeepAliveRelease();                                             // a handler kept client(), it is no longer closed when idle
 
   bool   SaveNetworkConfiguration(char *pJson);
   String DumpNetworkConfiguration();
+  void   DumpNetworkConfiguration(JsonDocument &doc);
   String GetUniqueDeviceName();
   String GetDeviceName() { return hstName; }
-  String GetContentType(String filename);
+  static const __FlashStringHelper* GetContentType(const String &filename);  // flash resident, no allocation
+  static void AddContentType(const char *ext, const char *type);               // pointers have to stay valid (literals)
   
   bool WebSocketConnected();
   void WebSocketSend(int num, String text);
   void WebSocketBroadcast(String text);
+  bool WebSocketSendJson(int num, const JsonDocument &doc);       // MessagePack binary frame to clients that sent "EspSetupMsgPack", else JSON text
+  void WebSocketBroadcastJson(const JsonDocument &doc);           // each client in its format, encoded once per format
+  bool WebSocketOta(uint8_t num, WStype_t type, uint8_t *payload, size_t len);  // handles "EspSetupOta" and its binary frames
   void AddWebSocketCallback(WebSocketServerEvent pFunction) { WebSocketCallbackList.push_back(pFunction); }
   std::vector<WebSocketServerEvent> GetWebSocketCallbackList() { return WebSocketCallbackList; }
 
   void TelnetCallback(TelnetCallbackFn pFunction) { pTelnetCallbackFn = pFunction; }
+  MqttService& Mqtt() { return mqtt; }                           // idle until Mqtt().Begin(), driven by Loop()
+  WifiScan& Scan() { return scan; }                              // background WiFi scan, results cached
+  void AddLogger(DataLogger &rLogger);                           // queried by GET /log?name=..&from=..&to=..&format=csv|json
+  void AddTcpService(TcpService &rService, uint16_t port = 0);   // driven by Loop(), port 0 replaces the telnet console on tcpPort
 
-  bool WriteFile(const String &rFilePath, const String &rData);
-  bool WriteFile(const String &rFilePath, const JsonDocument &rDoc);
+  void AddUdpCallback(UdpCallbackFn pFunction);                                            // Loop() reads udpPort once a callback is set
+  bool UdpSend(const IPAddress &ip, uint16_t port, const uint8_t *pData, size_t len);    // queued, sent after the callbacks returned
+  bool UdpReply(const UdpPacket &rPacket, const uint8_t *pData, size_t len) { return UdpSend(rPacket.remoteIP, rPacket.remotePort, pData, len); }
+  void UdpFlush();                                                                        // send queued datagrams now
+
+  bool WriteFile(const String &rFilePath, const String &rData, bool keepBackup = false);         // keepBackup: previous generation as <path>.bak
+  bool WriteFile(const String &rFilePath, const JsonDocument &rDoc, bool keepBackup = false);
   bool ReadFile(const String &rFilePath, String &rData);
+  bool ReadFile(const String &rFilePath, char *pBuffer, size_t size, size_t *pLength = nullptr);  // zero terminated, fails if size is too small
   bool ReadFile(const String &rFilePath, JsonDocument &rDoc);
+  bool ReadFile(const String &rFilePath, JsonDocument &rDoc, const JsonDocument &rFilter);           // only keys present in rFilter are stored
+  bool VisitFile(const String &rFilePath, const JsonDocument &rFilter, JsonVisitorFn pFunction, size_t docSize = 1024);  // calls pFunction per filtered top level key
+  static bool CommitFile(const String &rFilePath, bool keepBackup = false);   // rename <path>.tmp to <path>, optionally keeps <path>.bak
 
   static bool handleFileRead(String path);
   
   private:
+  friend class KeepAliveHandler;
+  friend class RouteHandler;
+  struct Route;
+  static const Route routeTable[];      // core routes sorted by path, see RouteHandler
+  void KeepAliveRequest();
+  void KeepAliveLoop();
   void OTASetup();
   void TcpLoop();
+  void TelnetSetup();
+  void UdpSetup();
+  void UdpLoop();
+  void TcpSetup();
+  void DnsSetup(bool enable);
+  void DnsLoop();
+  void ApplyLoop();
+  void WifiApply();
+  void ClientIpConfig();
+  String WifiSettings();
+  void EventLoop();
   void NtpLoop();
   bool StartAPMode();
   bool StartClientMode();
   bool LoadNetworkConfiguration();
   bool UpdateNetworkConfiguration(const char *pJson);
+  bool UpdateNetworkConfiguration(JsonObject obj);
   String formatBytes(size_t bytes);
+  const char* requestCookie();
 
-  Stream& console;
+  ConsoleLog console;
+  MqttService mqtt;
+  WifiScan scan;
   
   static void handleFileUpload();
+  static void handleChunkUpload();
+  static void handleChunkRequest();
   static void handleStatus();
+  static void handleUpdate();
+  static void handleUpdateUpload();
+  static void handleEvents();
   static void handleFileStatus();
   static void handleFileList();
-  static void deleteRecursive(String path);
+  static bool streamFileRange(File &file, const String &contentType);
+  static bool deleteRecursive(String path);
+  static bool copyRecursive(String src, String dst);
   static void handleFileDelete();
   static void handleFileCreate();
+  static void handleFileBulk(const String &op);
+  static void handleEditPage();
+  static void handleEditPost();
+  static void handleSetupPage();
+  static void handleReboot();
+  static void handleAll();
+  static void handleCaptive();
+  static void handleLogQuery();
+  static bool captiveRedirect();
  
   bool retryloop = true;
 
+  uint32_t  keepAliveTimeout = HTTP_KEEPALIVE_TIMEOUT;
+  int       keepAliveMax = HTTP_KEEPALIVE_MAX;
+  int       keepAliveCount = 0;       // requests on the current connection
+  uint32_t  keepAliveMillis = 0;
+  IPAddress keepAliveIP;
+  uint16_t  keepAlivePort = 0;
+
   // Servers (only instatiated when their correspondent ports are not zero)
   WiFiUDP    *pUdp = nullptr;
   WiFiServer *pTcp = nullptr;
-  WiFiClient TelnetClient[MAX_TELNET_CLIENTS];
+  TcpService *pTcpPortService = nullptr;   // service on tcpPort
+  TcpService *pTelnetService = nullptr;    // default service on tcpPort
+  std::vector<TcpService*> TcpServiceList;
+  UdpPacket  *pUdpRecv = nullptr;   // UDP_POOL_COUNT buffers, allocated by AddUdpCallback()
+  UdpPacket  *pUdpSend = nullptr;   // UDP_SEND_COUNT buffers, allocated by the first UdpSend()
+  int        udpSendCount = 0;
+  uint32_t   udpReceived = 0;
+  uint32_t   udpTruncated = 0;
+  WiFiUDP    *pDns = nullptr;       // captive portal DNS in AP mode
+  uint32_t   dnsWindow = 0;         // start of the current rate limit second
+  int        dnsCount = 0;          // queries within dnsWindow
+  uint32_t   dnsAnswered = 0;
+  uint32_t   dnsDropped = 0;
 
   std::vector<WebSocketServerEvent> WebSocketCallbackList;
   TelnetCallbackFn pTelnetCallbackFn = nullptr;
+  std::vector<UdpCallbackFn> UdpCallbackList;
+  std::vector<DataLogger*> LoggerList;
+
+  // SaveNetworkConfiguration() changes, taken over by ApplyLoop() without a reboot
+  enum ConfigChange { CFG_WIFI = 1, CFG_WEB = 2, CFG_UDP = 4, CFG_TCP = 8, CFG_NTP = 16, CFG_MDNS = 32, CFG_AUTH = 64 };
+  uint32_t configChanges = 0;
+  uint32_t wifiConnectMillis = 0;   // hot applied client connection in progress
 
   int    dsOveridePin = -1;
   bool   isApMode = false;
@@ -161,6 +356,7 @@ class EspSetup : public ESP8266WebServer
   int    gmtOffs = 0;
   bool   dsEnab = false;  // Deep Sleep enable
   uint32_t dsLoop = 0;    // Deep Sleep wake loop [ms]
+  String otaPass;         // ArduinoOTA, /update and WebSocket OTA password
 };
 
 class NullSerial : public Stream
@@ -0,0 +1,218 @@
+//=======================================================================
+// EspTcp.cpp Arduino EspSetup library ESP8266 / ESP32
+// Multi client TCP services with framed input and non-blocking output
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+
+#include "EspTcp.h"
+
+extern Stream *pEspConsole;
+
+// === class TcpConnection ===
+
+void TcpConnection::open(const WiFiClient &rClient) {
+  client = rClient;
+  client.setNoDelay(true);
+  active = true;
+  closing = false;
+  lastMillis = millis();
+  rxLen = rxNeed = 0;
+  txHead = txLen = 0;
+  pState = nullptr;
+}
+
+void TcpConnection::stop() {
+  client.stop();
+  active = false;
+  txLen = 0;
+}
+
+size_t TcpConnection::write(const uint8_t *pData, size_t size) {
+  if (!active || closing) return 0;
+  size_t n = 0;
+  while (n < size && txLen < TCP_QUEUE_SIZE) {
+    tx[(txHead + txLen) % TCP_QUEUE_SIZE] = pData[n++];
+    txLen++;
+  }
+  send();
+  return n;
+}
+
+/*
+   Send as much of the queue as fits into the TCP window, never waits for ACKs
+*/
+void TcpConnection::send() {
+  while (txLen > 0) {
+    int room = client.availableForWrite();
+    if (room <= 0) break;
+    size_t len = txLen;
+    if (len > TCP_QUEUE_SIZE - txHead) len = TCP_QUEUE_SIZE - txHead;   // up to the end of the ring
+    if (len > (size_t) room) len = room;
+    size_t sent = client.write(&tx[txHead], len);
+    if (sent == 0) break;
+    txHead = (txHead + sent) % TCP_QUEUE_SIZE;
+    txLen -= sent;
+    lastMillis = millis();
+  }
+}
+
+// === class TcpService ===
+
+TcpService::TcpService(const TcpFraming &framing, TcpFrameFn pFrameFn, TcpAcceptFn pAcceptFn, TcpCloseFn pCloseFn,
+                       int maxClients, uint32_t idleTimeout)
+  : framing(framing), frameFn(pFrameFn), acceptFn(pAcceptFn), closeFn(pCloseFn),
+    maxConn(maxClients > 0 ? maxClients : 1), idleTimeout(idleTimeout)
+{
+}
+
+TcpService::~TcpService()
+{
+  end();
+  delete[] pConn;
+}
+
+bool TcpService::allocate() {
+  if (!pConn) {
+    pConn = new TcpConnection[maxConn];
+  }
+  return pConn != nullptr;
+}
+
+bool TcpService::begin(uint16_t port) {
+  if (port == 0 || !allocate()) return false;
+  end();
+  pServer = new WiFiServer(port);
+  ownServer = true;
+  pServer->begin();
+  pServer->setNoDelay(true);
+  return true;
+}
+
+bool TcpService::begin(WiFiServer *pServer) {
+  if (!pServer || !allocate()) return false;
+  end();
+  this->pServer = pServer;
+  ownServer = false;
+  return true;
+}
+
+void TcpService::end() {
+  if (pConn) {
+    for (int i = 0; i < maxConn; i++) {
+      if (pConn[i].active) close(pConn[i]);
+    }
+  }
+  if (ownServer) {
+    pServer->stop();
+    delete pServer;
+  }
+  pServer = nullptr;
+  ownServer = false;
+}
+
+int TcpService::Connections() {
+  int count = 0;
+  for (int i = 0; pConn && i < maxConn; i++) {
+    if (pConn[i].active) count++;
+  }
+  return count;
+}
+
+void TcpService::Broadcast(const uint8_t *pData, size_t len) {
+  for (int i = 0; pConn && i < maxConn; i++) {
+    if (pConn[i].active) pConn[i].write(pData, len);
+  }
+}
+
+void TcpService::loop() {
+  if (!pServer) return;
+  accept();
+  for (int i = 0; i < maxConn; i++) {
+    TcpConnection &conn = pConn[i];
+    if (!conn.active) continue;
+    receive(conn);
+    if (!conn.active) continue;                  // closed by a protocol error
+    conn.send();
+    if (!conn.client.connected() && !conn.client.available()) {
+      close(conn);
+    } else if (conn.closing && conn.txLen == 0) {
+      close(conn);
+    } else if (idleTimeout && millis() - conn.lastMillis > idleTimeout) {
+      pEspConsole->printf("TCP: session %d idle\n", i + 1);
+      close(conn);
+    }
+  }
+}
+
+void TcpService::accept() {
+  while (pServer->hasClient()) {
+    int i = 0;
+    while (i < maxConn && pConn[i].active) i++;
+    if (i == maxConn) {
+      pEspConsole->println("TCP: no free sessions ... drop connection");
+      pServer->available().stop();
+      return;
+    }
+    TcpConnection &conn = pConn[i];
+    conn.open(pServer->available());
+    if (acceptFn && !acceptFn(conn)) {
+      conn.stop();
+      continue;
+    }
+    pEspConsole->printf("TCP: client %s connected to session %d\n", conn.RemoteIP().toString().c_str(), i + 1);
+  }
+}
+
+/*
+   Cut the available input into frames. Line frames are zero terminated, lines longer
+   than TCP_FRAME_MAX are delivered in pieces. A length frame larger than TCP_FRAME_MAX
+   is a protocol error and closes the connection.
+*/
+void TcpService::receive(TcpConnection &rConn) {
+  uint8_t buf[64];
+  int len;
+  while (rConn.active && (len = rConn.client.read(buf, sizeof(buf))) > 0) {
+    rConn.lastMillis = millis();
+    if (framing.type == TcpFraming::RAW) {
+      frameFn(rConn, buf, len);
+      continue;
+    }
+    for (int i = 0; i < len && rConn.active; i++) {
+      uint8_t c = buf[i];
+      if (framing.type == TcpFraming::LINE) {
+        if (c == '\r') continue;
+        if (c != '\n') rConn.rx[rConn.rxLen++] = c;
+        if (c == '\n' || rConn.rxLen == TCP_FRAME_MAX) {
+          rConn.rx[rConn.rxLen] = 0;
+          frameFn(rConn, rConn.rx, rConn.rxLen);
+          rConn.rxLen = 0;
+        }
+        continue;
+      }
+      rConn.rx[rConn.rxLen++] = c;
+      if (rConn.rxLen == framing.headerLen) {
+        int size = framing.headerLen + ((rConn.rx[framing.lenOffset] << 8) | rConn.rx[framing.lenOffset + 1]) + framing.lenAdjust;
+        if (size < framing.headerLen || size > TCP_FRAME_MAX) {
+          pEspConsole->println("TCP: frame too large ... terminate session");
+          close(rConn);
+          return;
+        }
+        rConn.rxNeed = size;
+      }
+      if (rConn.rxLen >= framing.headerLen && rConn.rxLen == rConn.rxNeed) {
+        frameFn(rConn, rConn.rx, rConn.rxLen);
+        rConn.rxLen = rConn.rxNeed = 0;
+      }
+    }
+  }
+}
+
+void TcpService::close(TcpConnection &rConn) {
+  rConn.send();                                 // last try for pending output
+  if (closeFn) closeFn(rConn);
+  rConn.stop();
+  pEspConsole->printf("TCP: session %d closed\n", (int) (&rConn - pConn) + 1);
+  rConn.pState = nullptr;
+}
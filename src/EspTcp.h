@@ -0,0 +1,112 @@
+//=======================================================================
+// EspTcp.h Arduino EspSetup library ESP8266 / ESP32
+// Multi client TCP services with framed input and non-blocking output
+// Author:  Wolfgang Kracht
+// Date:    7/19/2020
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+#pragma once
+
+#include <WiFiClient.h>
+#include <WiFiServer.h>
+#include <functional>
+
+#define TCP_FRAME_MAX 256           // largest line or frame delivered in one piece
+#define TCP_QUEUE_SIZE 512          // output queued per connection
+
+class TcpConnection;
+
+typedef std::function<bool(TcpConnection &rConn)> TcpAcceptFn;                                    // return false to reject
+typedef std::function<void(TcpConnection &rConn, const uint8_t *pData, size_t len)> TcpFrameFn;
+typedef std::function<void(TcpConnection &rConn)> TcpCloseFn;
+
+// How the input of a connection is cut into frames for the TcpFrameFn
+struct TcpFraming
+{
+  enum Type { RAW, LINE, LENGTH };
+
+  Type    type;
+  uint8_t headerLen;    // LENGTH: header size including the length field
+  uint8_t lenOffset;    // LENGTH: position of the big endian uint16 length in the header
+  int8_t  lenAdjust;    // LENGTH: frame size = headerLen + length + lenAdjust
+
+  static TcpFraming Raw() { return { RAW, 0, 0, 0 }; }           // whatever has been received
+  static TcpFraming Line() { return { LINE, 0, 0, 0 }; }         // lines without \r\n, zero terminated
+  static TcpFraming Length(uint8_t header = 2, uint8_t offset = 0, int8_t adjust = 0) { return { LENGTH, header, offset, adjust }; }
+  static TcpFraming ModbusTcp() { return Length(6, 4, 0); }      // MBAP header, length counts unit id and PDU
+};
+
+// One client of a TcpService. Output is queued and sent as the TCP window allows,
+// print() and write() never block. pState is free for the application, e.g. set
+// by the TcpAcceptFn and released by the TcpCloseFn.
+class TcpConnection : public Print
+{
+public:
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *pData, size_t size) override;        // returns less than size if the queue is full
+  using Print::write;
+
+  void Close() { closing = true; }                                 // closes when the queued output is sent
+  bool Connected() { return client && client.connected(); }
+  size_t Queued() const { return txLen; }
+  IPAddress RemoteIP() { return client.remoteIP(); }
+  uint16_t RemotePort() { return client.remotePort(); }
+  WiFiClient& Client() { return client; }
+
+  void *pState = nullptr;
+
+private:
+  friend class TcpService;
+
+  void open(const WiFiClient &rClient);
+  void stop();
+  void send();
+
+  WiFiClient client;
+  bool       active = false;
+  bool       closing = false;
+  uint32_t   lastMillis = 0;       // last input or output
+  uint8_t    rx[TCP_FRAME_MAX + 1];
+  size_t     rxLen = 0;
+  size_t     rxNeed = 0;           // LENGTH: complete frame size once the header is known
+  uint8_t    tx[TCP_QUEUE_SIZE];
+  size_t     txHead = 0;
+  size_t     txLen = 0;
+};
+
+// Accepts up to maxClients connections on a port and dispatches framed input.
+// EspSetup drives registered services from its Loop() (AddTcpService).
+class TcpService
+{
+public:
+  TcpService(const TcpFraming &framing, TcpFrameFn pFrameFn, TcpAcceptFn pAcceptFn = nullptr, TcpCloseFn pCloseFn = nullptr,
+             int maxClients = 2, uint32_t idleTimeout = 0);
+  virtual ~TcpService();
+
+  bool begin(uint16_t port);              // own server on port
+  bool begin(WiFiServer *pServer);        // use a server managed by somebody else
+  void end();
+  void loop();
+
+  bool Active() { return pServer != nullptr; }
+  int  Connections();
+  void Broadcast(const uint8_t *pData, size_t len);
+  void Broadcast(const String &text) { Broadcast((const uint8_t*) text.c_str(), text.length()); }
+
+private:
+  bool allocate();
+  void accept();
+  void receive(TcpConnection &rConn);
+  void close(TcpConnection &rConn);
+
+  TcpFraming  framing;
+  TcpFrameFn  frameFn;
+  TcpAcceptFn acceptFn;
+  TcpCloseFn  closeFn;
+  int         maxConn;
+  uint32_t    idleTimeout;          // ms without traffic before a connection is closed, 0 = never
+
+  WiFiServer    *pServer = nullptr;
+  bool           ownServer = false;
+  TcpConnection *pConn = nullptr;   // maxConn connections, allocated by begin()
+};
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Builds the delta decoder host test, creates image pairs (a rebuilt firmware is
+# simulated like in espdelta.py selftest), makes their patches with
+# tools/espdelta.py diff and decodes them with src/EspDelta.cpp. Needs g++ and python3.
+# sh test/delta/run.sh
+set -e
+cd "$(dirname "$0")/../.."
+OUT=${TMPDIR:-/tmp}/espsetup-delta-test
+mkdir -p "$OUT"
+
+g++ -std=gnu++17 -Wall -Isrc test/delta/test_delta.cpp src/EspDelta.cpp -o "$OUT/test_delta"
+
+RESULT=0
+for SEED in 1 2 3 4 5; do
+  python3 - "$OUT" "$SEED" <<'PY'
+import random, sys
+sys.path.insert(0, "tools")
+import espdelta
+out, seed = sys.argv[1], int(sys.argv[2])
+rnd = random.Random(seed)
+old = bytes(rnd.randrange(256) for _ in range(rnd.randint(1000, 120000)))
+new = espdelta.mutate(rnd, old) if seed > 1 else old
+open(out + "/old.bin", "wb").write(old)
+open(out + "/new.bin", "wb").write(new)
+PY
+  python3 tools/espdelta.py diff "$OUT/old.bin" "$OUT/new.bin" "$OUT/patch.bin" > /dev/null
+  MD5=$(python3 -c "import hashlib, sys; print(hashlib.md5(open(sys.argv[1], 'rb').read()).hexdigest())" "$OUT/old.bin")
+  echo "seed $SEED:"
+  "$OUT/test_delta" "$OUT/old.bin" "$OUT/new.bin" "$OUT/patch.bin" "$MD5" || RESULT=1
+done
+exit $RESULT
@@ -0,0 +1,111 @@
+//=======================================================================
+// test_delta.cpp Arduino EspSetup library ESP8266 / ESP32
+// Host test of DeltaDecoder with a patch made by tools/espdelta.py diff. The
+// patch is fed whole, byte by byte and in random fragments, the rebuilt image
+// has to match the new one byte for byte. A patch for another source image
+// (wrong MD5 in its header) and a truncated patch have to fail. Run by
+// test/delta/run.sh.
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+
+#include "EspDelta.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef std::vector<uint8_t> Bytes;
+
+static Bytes old, expected;
+static std::string oldMd5;
+
+static bool load(const char *pPath, Bytes &rData) {
+  FILE *f = fopen(pPath, "rb");
+  if (!f) return false;
+  uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) rData.insert(rData.end(), buf, buf + n);
+  fclose(f);
+  return true;
+}
+
+// like otaDeltaHeader(): the patch has to be made for the running sketch
+static bool header(const DeltaDecoder &delta) {
+  char md5[33];
+  for (int i = 0; i < 16; i++) {
+    sprintf(&md5[2 * i], "%02x", delta.OldMd5()[i]);
+  }
+  return delta.OldSize() == old.size() && oldMd5 == md5;
+}
+
+/*
+   Feeds the patch in fragments of 1..maxFragment bytes (0: all at once), returns
+   the rebuilt image, rDone tells whether the decoder completed
+*/
+static Bytes decode(const Bytes &patch, size_t maxFragment, bool &rDone, unsigned seed = 1) {
+  Bytes out;
+  DeltaDecoder delta(
+    [](uint32_t offset, uint8_t *pData, size_t len) {
+      // the flash behind the sketch is readable, the block may reach past its end
+      if (offset % DELTA_BLOCK_SIZE || len != DELTA_BLOCK_SIZE) return false;
+      memset(pData, 0xFF, len);
+      if (offset < old.size()) memcpy(pData, &old[offset], std::min(len, old.size() - offset));
+      return true;
+    },
+    [&out](const uint8_t *pData, size_t len) { out.insert(out.end(), pData, pData + len); return true; },
+    header);
+  std::mt19937 rnd(seed);
+  size_t pos = 0;
+  bool ok = true;
+  while (ok && pos < patch.size()) {
+    size_t n = maxFragment ? 1 + rnd() % maxFragment : patch.size();
+    n = std::min(n, patch.size() - pos);
+    ok = delta.Write(&patch[pos], n);
+    pos += n;
+  }
+  rDone = ok && delta.Done() && delta.Written() == out.size();
+  return out;
+}
+
+int main(int argc, char *argv[]) {
+  Bytes patch;
+  if (argc != 5 || !load(argv[1], old) || !load(argv[2], expected) || !load(argv[3], patch)) {
+    puts("usage: test_delta <old.bin> <new.bin> <patch.bin> <md5 of old.bin>");
+    return 2;
+  }
+  oldMd5 = argv[4];
+
+  int errors = 0;
+  static const size_t fragments[] = { 0, 1, 7, 64, DELTA_BLOCK_SIZE + 3, 1460 };
+  for (size_t max : fragments) {
+    bool done;
+    Bytes out = decode(patch, max, done, max + 1);
+    if (!done || out != expected) {
+      printf("FAIL: fragments up to %u bytes: done %d, %u of %u bytes, %s\n", (unsigned) max, done,
+             (unsigned) out.size(), (unsigned) expected.size(), out == expected ? "equal" : "different");
+      errors++;
+    }
+  }
+
+  Bytes wrong = patch;
+  wrong[9] ^= 1;                          // first byte of the old image MD5
+  bool done;
+  if (!decode(wrong, 0, done).empty() || done) {
+    puts("FAIL: patch with a wrong source MD5 was applied");
+    errors++;
+  }
+
+  Bytes truncated(patch.begin(), patch.end() - 1);
+  decode(truncated, 5, done);
+  if (done) {
+    puts("FAIL: truncated patch completed");
+    errors++;
+  }
+
+  printf("old %u new %u patch %u bytes\n", (unsigned) old.size(), (unsigned) expected.size(), (unsigned) patch.size());
+  puts(errors ? "FAILED" : "PASSED");
+  return errors ? 1 : 0;
+}
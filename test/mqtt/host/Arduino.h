@@ -0,0 +1,79 @@
+//=======================================================================
+// Arduino.h host stand-in for the EspSetup MQTT test
+// Just enough of String, Stream, IPAddress, ESP and millis() for EspMqtt.cpp
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+#pragma once
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#define HEX 16
+
+inline unsigned long millis() {
+  using namespace std::chrono;
+  static auto start = steady_clock::now();
+  return duration_cast<milliseconds>(steady_clock::now() - start).count();
+}
+
+class String : public std::string
+{
+public:
+  using std::string::string;
+  String() = default;
+  String(const std::string &s) : std::string(s) {}
+  String(uint32_t value, int base) {
+    char text[16];
+    snprintf(text, sizeof(text), base == HEX ? "%x" : "%u", value);
+    assign(text);
+  }
+  bool isEmpty() const { return empty(); }
+  int indexOf(char c) const { size_t pos = find(c); return pos == npos ? -1 : (int) pos; }
+  String substring(size_t from) const { return String(substr(from)); }
+  String substring(size_t from, size_t to) const { return String(substr(from, to - from)); }
+};
+
+inline String operator+(const char *a, const String &b) { return String(std::string(a) + b); }
+
+class Stream
+{
+public:
+  void println(const char *s) { puts(s); }
+  int printf(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+  }
+  void setTimeout(unsigned long ms) { timeout = ms; }
+
+protected:
+  unsigned long timeout = 1000;
+};
+
+class IPAddress
+{
+public:
+  bool fromString(const String &s) {
+    unsigned b[4];
+    if (sscanf(s.c_str(), "%u.%u.%u.%u", &b[0], &b[1], &b[2], &b[3]) != 4) return false;
+    addr = b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+    return true;
+  }
+  String toString() const {
+    char text[16];
+    snprintf(text, sizeof(text), "%u.%u.%u.%u", addr >> 24, (addr >> 16) & 255, (addr >> 8) & 255, addr & 255);
+    return String(text);
+  }
+  uint32_t addr = 0;
+};
+
+struct EspClass {
+  uint32_t getChipId() { return 0x123456; }
+};
+extern EspClass ESP;
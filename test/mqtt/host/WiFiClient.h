@@ -0,0 +1,71 @@
+//=======================================================================
+// WiFiClient.h host stand-in for the EspSetup MQTT test
+// Non-blocking POSIX socket with the WiFiClient calls used by EspMqtt.cpp
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+#pragma once
+
+#include "Arduino.h"
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+class WiFiClient : public Stream
+{
+public:
+  int connect(IPAddress ip, uint16_t port) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(ip.addr);
+    if (::connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+      stop();
+      return 0;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return 1;
+  }
+  void setNoDelay(bool on) {
+    int flag = on;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  }
+  int available() {
+    if (fd < 0) return 0;
+    char c;
+    int n = recv(fd, &c, 1, MSG_PEEK);
+    if (n == 0) closed = true;
+    return n > 0 ? 1 : 0;
+  }
+  int read() {
+    uint8_t c;
+    return read(&c, 1) == 1 ? c : -1;
+  }
+  int read(uint8_t *pBuf, size_t len) {
+    if (fd < 0) return -1;
+    int n = recv(fd, pBuf, len, 0);
+    if (n == 0) closed = true;
+    return n;
+  }
+  size_t write(const uint8_t *pBuf, size_t len) {
+    if (fd < 0) return 0;
+    ssize_t n = send(fd, pBuf, len, MSG_NOSIGNAL);
+    return n < 0 ? 0 : n;
+  }
+  int availableForWrite() { return fd < 0 ? 0 : 1460; }
+  uint8_t connected() {
+    available();
+    return fd >= 0 && !closed;
+  }
+  void stop() {
+    if (fd >= 0) close(fd);
+    fd = -1;
+    closed = false;
+  }
+
+private:
+  int  fd = -1;
+  bool closed = false;
+};
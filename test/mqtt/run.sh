@@ -0,0 +1,49 @@
+#!/bin/sh
+# Builds the MQTT host test and runs it against tools/mqttbroker.py, which
+# drops every connection at its 6th packet, then checks the subscriptions
+# against a second broker on port+1 that injects the topics below. Needs g++
+# and python3.
+# sh test/mqtt/run.sh [port]
+set -e
+cd "$(dirname "$0")/../.."
+PORT=${1:-18830}
+OUT=${TMPDIR:-/tmp}/espsetup-mqtt-test
+mkdir -p "$OUT"
+
+g++ -std=gnu++17 -Wall -Itest/mqtt/host -Isrc test/mqtt/test_mqtt.cpp src/EspMqtt.cpp -o "$OUT/test_mqtt"
+
+python3 -u tools/mqttbroker.py --port "$PORT" --drop 6 > "$OUT/broker.log" 2>&1 &
+BROKER=$!
+trap 'kill $BROKER 2>/dev/null' EXIT
+sleep 1
+
+RESULT=0
+"$OUT/test_mqtt" "$PORT" || RESULT=1
+if ! grep -q "PUBLISH DUP qos 1 test/q" "$OUT/broker.log"; then
+  echo "FAIL: broker got no resend with the DUP flag"
+  RESULT=1
+fi
+for i in $(seq 0 11); do
+  if ! grep -q "PUBLISH.* qos 1 test/q b'm$i'" "$OUT/broker.log"; then
+    echo "FAIL: message m$i never reached the broker"
+    RESULT=1
+  fi
+done
+[ $RESULT -eq 0 ] || echo "broker log: $OUT/broker.log"
+
+# subscribed and unsubscribed topics, the expected callbacks are in test_mqtt.cpp
+SUB_PORT=$((PORT + 1))
+python3 -u tools/mqttbroker.py --port "$SUB_PORT" \
+  --inject sensor/kitchen/temp --inject sensor/kitchen/humidity --inject sensor \
+  --inject device/status --inject device/x/status --inject other \
+  --inject '$SYS/broker/load' --inject '$SYS/status' \
+  --inject exact/topic --inject exact/topic/sub --inject exact \
+  --inject test/end > "$OUT/broker-sub.log" 2>&1 &
+SUB_BROKER=$!
+trap 'kill $BROKER $SUB_BROKER 2>/dev/null' EXIT
+sleep 1
+if ! "$OUT/test_mqtt" "$SUB_PORT" subscribe; then
+  echo "broker log: $OUT/broker-sub.log"
+  RESULT=1
+fi
+exit $RESULT
@@ -0,0 +1,103 @@
+//=======================================================================
+// test_mqtt.cpp Arduino EspSetup library ESP8266 / ESP32
+// Host test of MqttService against tools/mqttbroker.py started with --drop,
+// checks the reconnects and that every QoS 1 message gets acknowledged. Run by
+// test/mqtt/run.sh, the broker log is checked there for DUP flags and gaps.
+// With "subscribe" it checks the filter matching against a broker started with
+// the --inject topics listed in run.sh.
+// Licence: https://www.gnu.org/licenses/gpl-3.0
+//=======================================================================
+
+#include "EspMqtt.h"
+#include <algorithm>
+#include <thread>
+
+#define MESSAGES 12
+#define TIMEOUT 30000
+
+EspClass ESP;
+Stream console;
+Stream *pEspConsole = &console;
+
+// filter, then the topics injected by the broker that have to reach its callback
+static const struct { const char *filter; const char *topics[4]; } subscriptions[] = {
+  { "sensor/+/temp", { "sensor/kitchen/temp" } },
+  { "sensor/#",      { "sensor/kitchen/temp", "sensor/kitchen/humidity", "sensor" } },
+  { "+/status",      { "device/status" } },
+  { "+",             { "sensor", "other", "exact" } },
+  { "$SYS/#",        { "$SYS/broker/load", "$SYS/status" } },
+  { "exact/topic",   { "exact/topic" } },
+  { "test/end",      { "test/end" } },      // injected last
+};
+
+static int testSubscribe(const char *port) {
+  MqttService mqtt;
+  std::vector<std::string> calls;
+  bool end = false;
+  for (const auto &sub : subscriptions) {
+    std::string filter = sub.filter;
+    mqtt.Subscribe(sub.filter, [&, filter](const char *topic, const uint8_t *payload, size_t len) {
+      if (std::string((const char*) payload, len) != topic) puts("FAIL: payload is not the topic");
+      calls.push_back(filter + " " + topic);
+      if (filter == "test/end") end = true;
+    });
+  }
+  if (!mqtt.Begin("127.0.0.1", atoi(port), "user", "pass", "host-test-sub")) return 1;
+  mqtt.Publish("broker/inject", "", 1);   // queued behind the SUBSCRIBE packets
+
+  unsigned long start = millis();
+  while (!end && millis() - start < TIMEOUT) {
+    mqtt.Loop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  mqtt.End();
+
+  std::vector<std::string> expected;
+  for (const auto &sub : subscriptions) {
+    for (const char *topic : sub.topics) {
+      if (topic) expected.push_back(std::string(sub.filter) + " " + topic);
+    }
+  }
+  std::sort(calls.begin(), calls.end());
+  std::sort(expected.begin(), expected.end());
+  int errors = 0;
+  for (const std::string &call : calls) {
+    if (!std::binary_search(expected.begin(), expected.end(), call)) { printf("FAIL: unexpected call %s\n", call.c_str()); errors++; }
+  }
+  for (const std::string &call : expected) {
+    if (std::count(calls.begin(), calls.end(), call) != 1) { printf("FAIL: %s called %d times\n", call.c_str(), (int) std::count(calls.begin(), calls.end(), call)); errors++; }
+  }
+  printf("callbacks %u received %u\n", (unsigned) calls.size(), mqtt.GetStats().received);
+  puts(errors ? "FAILED" : "PASSED");
+  return errors ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *port = argc > 1 ? argv[1] : "1883";
+  if (argc > 2 && !strcmp(argv[2], "subscribe")) return testSubscribe(port);
+  MqttService mqtt;
+  if (!mqtt.Begin("127.0.0.1", atoi(port), "user", "pass", "host-test")) return 1;
+
+  // queued before the first connect, the QoS 0 messages in between are not sent again
+  for (int i = 0; i < MESSAGES; i++) {
+    mqtt.Publish("test/q", "m" + String(i, 10), 1);
+    mqtt.Publish("test/z", "z" + String(i, 10), 0);
+  }
+
+  unsigned long start = millis();
+  while (mqtt.GetStats().acked < MESSAGES && millis() - start < TIMEOUT) {
+    mqtt.Loop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  mqtt.End();
+
+  const MqttService::Stats &s = mqtt.GetStats();
+  printf("published %u sent %u acked %u connects %u failures %u\n",
+         s.published, s.sent, s.acked, s.connects, s.failures);
+  int errors = 0;
+  if (s.acked != MESSAGES) { puts("FAIL: not all QoS 1 messages acknowledged"); errors++; }
+  if (s.connects < 2) { puts("FAIL: no reconnect"); errors++; }
+  if (s.sent <= s.published) { puts("FAIL: nothing was sent again"); errors++; }
+  puts(errors ? "FAILED" : "PASSED");
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,252 @@
+#!/usr/bin/env python3
+#=======================================================================
+# espdelta.py Arduino EspSetup library ESP8266 / ESP32
+# Generates and applies delta patches for firmware updates, the device
+# side decoder is DeltaDecoder (src/EspDelta.h), which also documents
+# the patch format.
+#
+# espdelta.py diff  <old.bin> <new.bin> <patch.bin>   create a patch (verified by applying it)
+# espdelta.py apply <old.bin> <patch.bin> <new.bin>   apply a patch like the device does
+# espdelta.py selftest                                 round trip random images
+#
+# upload the patch with: POST /update?type=delta (see EspSetup README)
+# Licence: https://www.gnu.org/licenses/gpl-3.0
+#=======================================================================
+
+import hashlib
+import random
+import struct
+import sys
+
+MAGIC = b"ESPD"
+VERSION = 1
+OP_END, OP_COPY, OP_DIFF, OP_INSERT = 0, 1, 2, 3
+
+KEY_LEN = 16        # minimum exact match to start a COPY/DIFF
+INDEX_STEP = 4      # old image positions indexed (firmware is word aligned)
+WINDOW = 16         # approximate extension stops below WINDOW/2 matches in the last WINDOW bytes
+
+
+def varint(v):
+    out = bytearray()
+    while True:
+        b = v & 0x7F
+        v >>= 7
+        if v:
+            out.append(b | 0x80)
+        else:
+            out.append(b)
+            return bytes(out)
+
+
+def zigzag(v):
+    return (v << 1) if v >= 0 else ((-v << 1) - 1)
+
+
+def header(old, new):
+    return (MAGIC + bytes([VERSION]) + struct.pack("<I", len(old)) + hashlib.md5(old).digest()
+            + struct.pack("<I", len(new)) + hashlib.md5(new).digest())
+
+
+def extend(old, o, new, p):
+    """length of the approximate match of new[p:] against old[o:]"""
+    n = 0
+    last = 0            # end of the last matching byte
+    window = []
+    matches = 0
+    limit = min(len(old) - o, len(new) - p)
+    while n < limit:
+        hit = old[o + n] == new[p + n]
+        window.append(hit)
+        matches += hit
+        if len(window) > WINDOW:
+            matches -= window.pop(0)
+        n += 1
+        if hit:
+            last = n
+        if len(window) == WINDOW and matches < WINDOW // 2:
+            break
+    return last
+
+
+def encode_diff(diff):
+    out = bytearray()
+    pos = 0
+    while pos < len(diff):
+        zeros = 0
+        while pos + zeros < len(diff) and diff[pos + zeros] == 0:
+            zeros += 1
+        out += varint(zeros)
+        pos += zeros
+        if pos == len(diff):
+            break
+        # literal run, short zero gaps are cheaper inline than a new group
+        end = pos
+        while end < len(diff) and end - pos < 255:
+            if diff[end] == 0 and diff[end:end + 3] == b"\0\0\0":
+                break
+            end += 1
+        out.append(end - pos)
+        out += diff[pos:end]
+        pos = end
+    return bytes(out)
+
+
+def diff(old, new):
+    index = {}
+    for i in range(0, len(old) - KEY_LEN + 1, INDEX_STEP):
+        index.setdefault(old[i:i + KEY_LEN], i)
+
+    patch = bytearray(header(old, new))
+    literal = bytearray()
+    oldpos = 0
+    p = 0
+
+    def flush_literal():
+        if literal:
+            patch.append(OP_INSERT)
+            patch.extend(varint(len(literal)))
+            patch.extend(literal)
+            literal.clear()
+
+    while p < len(new):
+        o = index.get(new[p:p + KEY_LEN])
+        if o is None:
+            literal.append(new[p])
+            p += 1
+            continue
+        # take back literal bytes that match exactly in front of the match
+        while literal and o > 0 and old[o - 1] == literal[-1]:
+            literal.pop()
+            o -= 1
+            p -= 1
+        n = extend(old, o, new, p)
+        flush_literal()
+        d = bytes((new[p + i] - old[o + i]) & 0xFF for i in range(n))
+        if d.count(0) == n:
+            patch.append(OP_COPY)
+            patch += varint(zigzag(o - oldpos)) + varint(n)
+        else:
+            patch.append(OP_DIFF)
+            patch += varint(zigzag(o - oldpos)) + varint(n) + encode_diff(d)
+        oldpos = o + n
+        p += n
+    flush_literal()
+    patch.append(OP_END)
+    return bytes(patch)
+
+
+def apply(old, patch):
+    if patch[:4] != MAGIC or patch[4] != VERSION:
+        raise ValueError("not a delta patch")
+    old_size, = struct.unpack_from("<I", patch, 5)
+    new_size, = struct.unpack_from("<I", patch, 25)
+    if old_size != len(old) or hashlib.md5(old).digest() != patch[9:25]:
+        raise ValueError("patch does not match the old image")
+    pos = 45
+    oldpos = 0
+    new = bytearray()
+
+    def read_varint():
+        nonlocal pos
+        v = shift = 0
+        while True:
+            b = patch[pos]
+            pos += 1
+            v |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                return v
+
+    while True:
+        op = patch[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op in (OP_COPY, OP_DIFF):
+            z = read_varint()
+            oldpos += (z >> 1) ^ -(z & 1)
+            n = read_varint()
+            if op == OP_COPY:
+                new += old[oldpos:oldpos + n]
+                oldpos += n
+                continue
+            remain = n
+            while remain:
+                zeros = read_varint()
+                new += old[oldpos:oldpos + zeros]
+                oldpos += zeros
+                remain -= zeros
+                if not remain:
+                    break
+                count = patch[pos]
+                pos += 1
+                for i in range(count):
+                    new.append((old[oldpos + i] + patch[pos + i]) & 0xFF)
+                pos += count
+                oldpos += count
+                remain -= count
+        elif op == OP_INSERT:
+            n = read_varint()
+            new += patch[pos:pos + n]
+            pos += n
+        else:
+            raise ValueError("bad operation %d at %d" % (op, pos - 1))
+    if len(new) != new_size or hashlib.md5(new).digest() != patch[29:45]:
+        raise ValueError("result does not match the new image")
+    return bytes(new)
+
+
+def mutate(rnd, old):
+    """simulate a rebuilt firmware: edits, inserted and removed code, shifted addresses"""
+    new = bytearray(old)
+    for _ in range(rnd.randint(1, 20)):
+        pos = rnd.randrange(len(new))
+        kind = rnd.randrange(3)
+        if kind == 0:
+            new[pos:pos] = bytes(rnd.randrange(256) for _ in range(rnd.randint(1, 300)))
+        elif kind == 1:
+            del new[pos:pos + rnd.randint(1, 300)]
+        else:
+            for i in range(pos, min(pos + 2000, len(new) - 4), 16):
+                new[i] = (new[i] + 4) & 0xFF
+    return bytes(new)
+
+
+def selftest():
+    rnd = random.Random(4711)
+    for i in range(20):
+        old = bytes(rnd.randrange(256) for _ in range(rnd.randint(1000, 60000)))
+        new = mutate(rnd, old) if i else old
+        patch = diff(old, new)
+        if apply(old, patch) != new:
+            print("selftest %d FAILED" % i)
+            return 1
+        print("selftest %d: old %d new %d patch %d bytes" % (i, len(old), len(new), len(patch)))
+    print("selftest passed")
+    return 0
+
+
+def main():
+    if len(sys.argv) == 2 and sys.argv[1] == "selftest":
+        return selftest()
+    if len(sys.argv) != 5 or sys.argv[1] not in ("diff", "apply"):
+        print(__doc__ if __doc__ else "usage: espdelta.py diff|apply <in> <in> <out> | selftest")
+        return 1
+    with open(sys.argv[2], "rb") as f:
+        old = f.read()
+    with open(sys.argv[3], "rb") as f:
+        data = f.read()
+    if sys.argv[1] == "diff":
+        out = diff(old, data)
+        apply(old, out)     # never ship a patch that does not reproduce the new image
+        print("patch %d bytes for %d byte image (%.1f%%)" % (len(out), len(data), 100.0 * len(out) / max(len(data), 1)))
+    else:
+        out = apply(old, data)
+    with open(sys.argv[4], "wb") as f:
+        f.write(out)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
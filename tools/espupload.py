@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+#=======================================================================
+# espupload.py Arduino EspSetup library ESP8266 / ESP32
+# Resumable, checksummed upload of files to one or many EspSetup devices
+# using the chunked upload protocol of /edit (see EspSetup::handleChunkRequest).
+#
+# usage: espupload.py [options] <local file> <remote path> <host> [host ...]
+# Licence: https://www.gnu.org/licenses/gpl-3.0
+#=======================================================================
+
+import argparse
+import base64
+import hashlib
+import json
+import sys
+import time
+import urllib.error
+import urllib.parse
+import urllib.request
+import uuid
+import zlib
+
+
+class Device:
+    def __init__(self, host, user=None, password=None, timeout=10):
+        self.base = host if host.startswith("http") else "http://" + host
+        self.timeout = timeout
+        self.headers = {}
+        if user:
+            token = base64.b64encode(("%s:%s" % (user, password or "")).encode()).decode()
+            self.headers["Authorization"] = "Basic " + token
+
+    def request(self, params, data=None):
+        """POST /edit with the query params, data is sent as multipart file part"""
+        url = self.base + "/edit?" + urllib.parse.urlencode(params)
+        headers = dict(self.headers)
+        body = b""
+        if data is not None:
+            boundary = uuid.uuid4().hex
+            headers["Content-Type"] = "multipart/form-data; boundary=" + boundary
+            body = (("--%s\r\nContent-Disposition: form-data; name=\"data\"; filename=\"chunk\"\r\n"
+                     "Content-Type: application/octet-stream\r\n\r\n") % boundary).encode()
+            body += data + ("\r\n--%s--\r\n" % boundary).encode()
+        req = urllib.request.Request(url, data=body, headers=headers, method="POST")
+        try:
+            with urllib.request.urlopen(req, timeout=self.timeout) as res:
+                return res.status, json.loads(res.read() or b"{}")
+        except urllib.error.HTTPError as err:
+            try:
+                return err.code, json.loads(err.read() or b"{}")
+            except ValueError:
+                return err.code, {}
+
+
+def upload(dev, content, remote, chunk_size, retries, upload_id=None):
+    sha256 = hashlib.sha256(content).hexdigest()
+    offset = 0
+    if upload_id:
+        status, reply = dev.request({"op": "status", "id": upload_id})
+        if status != 200:
+            upload_id = None
+        else:
+            offset = reply["offset"]
+    if not upload_id:
+        status, reply = dev.request({"op": "begin", "path": remote, "size": len(content), "sha256": sha256})
+        if status != 200:
+            raise RuntimeError("begin failed with HTTP %d" % status)
+        upload_id = reply["id"]
+
+    failures = 0
+    start = time.time()
+    while offset < len(content):
+        chunk = content[offset:offset + chunk_size]
+        params = {"op": "chunk", "id": upload_id, "offset": offset, "crc": "%08x" % (zlib.crc32(chunk) & 0xffffffff)}
+        try:
+            status, reply = dev.request(params, chunk)
+        except (OSError, urllib.error.URLError) as err:
+            status, reply = 0, {}
+            print("  %s" % err)
+        if status == 200:
+            offset = reply["offset"]
+            failures = 0
+            print("  %d/%d bytes" % (offset, len(content)), end="\r")
+            continue
+        failures += 1
+        if failures > retries:
+            raise RuntimeError("giving up at offset %d (upload id %s)" % (offset, upload_id))
+        time.sleep(min(2 ** failures, 30))
+        # resume from the offset committed by the device
+        try:
+            status, reply = dev.request({"op": "status", "id": upload_id})
+            if status == 200:
+                offset = reply["offset"]
+        except (OSError, urllib.error.URLError):
+            pass
+
+    status, reply = dev.request({"op": "commit", "id": upload_id})
+    if status != 200:
+        raise RuntimeError("verification failed with HTTP %d (upload id %s)" % (status, upload_id))
+    secs = max(time.time() - start, 0.001)
+    print("  %d bytes in %.1f s (%.1f kB/s)" % (len(content), secs, len(content) / secs / 1024))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="resumable upload to EspSetup devices")
+    parser.add_argument("file", help="local file")
+    parser.add_argument("path", help="remote path on LittleFS, e.g. /data/table.bin")
+    parser.add_argument("hosts", nargs="+", help="device host names or IPs")
+    parser.add_argument("--chunk", type=int, default=8192, help="chunk size in bytes")
+    parser.add_argument("--retries", type=int, default=10, help="retries per chunk")
+    parser.add_argument("--id", help="resume the given upload id (single host only)")
+    parser.add_argument("--user", help="web server user")
+    parser.add_argument("--password", help="web server password")
+    args = parser.parse_args()
+
+    with open(args.file, "rb") as f:
+        content = f.read()
+
+    failed = []
+    for host in args.hosts:
+        print("%s:" % host)
+        try:
+            upload(Device(host, args.user, args.password), content, args.path, args.chunk, args.retries, args.id)
+        except (RuntimeError, OSError, urllib.error.URLError) as err:
+            print("  FAILED: %s" % err)
+            failed.append(host)
+    if failed:
+        print("failed hosts: %s" % " ".join(failed))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
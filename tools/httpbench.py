@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+#=======================================================================
+# httpbench.py Arduino EspSetup library ESP8266 / ESP32
+# Loads the requests the setup and editor pages issue when they are opened
+# (pages, /status, /list, config files) from an EspSetup device, once with a new
+# connection per request and once over persistent (keep-alive) connections,
+# and prints requests per second and latencies of both runs.
+#
+# python tools/httpbench.py <host> [--rounds 20] [--user name --password pw]
+# Licence: https://www.gnu.org/licenses/gpl-3.0
+#=======================================================================
+
+import argparse
+import base64
+import http.client
+import statistics
+import time
+
+PATHS = ["/edit", "/status", "/list?dir=/", "/list?dir=/esp", "/setup", "/esp/network.json", "/all", "/favicon.ico"]
+
+
+def run(host, port, rounds, headers, keepalive):
+    latencies = []
+    errors = 0
+    conn = None
+    start = time.monotonic()
+    for _ in range(rounds):
+        for path in PATHS:
+            if conn is None or not keepalive:
+                if conn:
+                    conn.close()
+                conn = http.client.HTTPConnection(host, port, timeout=10)
+            t = time.monotonic()
+            try:
+                conn.request("GET", path, headers=headers)
+                resp = conn.getresponse()
+                resp.read()
+                if resp.status >= 400:
+                    errors += 1
+                if resp.will_close:                 # max requests reached or server side close
+                    conn.close()
+                    conn = None
+            except (OSError, http.client.HTTPException):
+                errors += 1
+                conn.close()
+                conn = None
+            latencies.append((time.monotonic() - t) * 1000)
+    if conn:
+        conn.close()
+    total = time.monotonic() - start
+    return len(latencies) / total, latencies, errors
+
+
+def main():
+    parser = argparse.ArgumentParser(description="EspSetup web server keep-alive benchmark")
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--rounds", type=int, default=20)
+    parser.add_argument("--user")
+    parser.add_argument("--password", default="")
+    args = parser.parse_args()
+
+    headers = {}
+    if args.user:
+        token = base64.b64encode(("%s:%s" % (args.user, args.password)).encode()).decode()
+        headers["Authorization"] = "Basic " + token
+
+    for name, keepalive in (("close", False), ("keep-alive", True)):
+        if not keepalive:
+            headers["Connection"] = "close"
+        else:
+            headers.pop("Connection", None)
+        rps, lat, errors = run(args.host, args.port, args.rounds, headers, keepalive)
+        lat.sort()
+        print("%-10s %6.1f req/s  median %6.1f ms  p95 %6.1f ms  max %6.1f ms  errors %d" %
+              (name, rps, statistics.median(lat), lat[int(len(lat) * 0.95) - 1], lat[-1], errors))
+
+
+if __name__ == "__main__":
+    main()
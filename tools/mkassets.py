@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+#=======================================================================
+# mkassets.py Arduino EspSetup library ESP8266 / ESP32
+# Converts files of the data folder into a PROGMEM asset bundle header
+# (EspAssets.h) served by EspSetup::handleFileRead() when the sketch is
+# built with -DESPSETUP_ASSETS. Files on LittleFS still override them.
+#
+# command line: mkassets.py <data dir> <output header> [file ...]
+# PlatformIO:   extra_scripts = pre:<path to>/tools/mkassets.py
+#               (reads data_dir, writes include/EspAssets.h)
+# Licence: https://www.gnu.org/licenses/gpl-3.0
+#=======================================================================
+
+import gzip
+import os
+import sys
+
+# the core UI, never changes between firmware updates
+DEFAULT_FILES = ["esp/edit.htm", "esp/msgpack.js", "esp/setup.htm", "favicon.ico"]
+
+
+def compress(data):
+    # mtime=0 keeps the output reproducible between builds
+    return gzip.compress(data, compresslevel=9, mtime=0)
+
+
+def generate(data_dir, out_path, files):
+    assets = []
+    for name in files:
+        src = os.path.join(data_dir, name)
+        if not os.path.isfile(src):
+            print("mkassets: skipping missing file %s" % src)
+            continue
+        with open(src, "rb") as f:
+            raw = f.read()
+        path = "/" + name.replace(os.sep, "/").lstrip("/")
+        assets.append((path, compress(raw), len(raw)))
+
+    # the index is searched binary, keep it sorted by path
+    assets.sort(key=lambda a: a[0])
+
+    lines = []
+    lines.append("// generated by tools/mkassets.py from %s - do not edit" % os.path.basename(os.path.normpath(data_dir)))
+    lines.append("#pragma once")
+    lines.append("")
+    lines.append("#define ESP_ASSET_COUNT %d" % len(assets))
+    lines.append("")
+    for i, (path, data, size) in enumerate(assets):
+        lines.append("// %s %d bytes, %d bytes gzipped" % (path, size, len(data)))
+        lines.append("static const char EspAssetPath%d[] PROGMEM = \"%s\";" % (i, path))
+        lines.append("static const uint8_t EspAssetData%d[] PROGMEM = {" % i)
+        for pos in range(0, len(data), 24):
+            lines.append("  " + ",".join("0x%02x" % b for b in data[pos:pos + 24]) + ",")
+        lines.append("};")
+        lines.append("")
+    lines.append("static const EspAsset EspAssets[] PROGMEM = {")
+    for i, (path, data, size) in enumerate(assets):
+        lines.append("  { EspAssetPath%d, EspAssetData%d, %d }," % (i, i, len(data)))
+    if not assets:
+        lines.append("  { nullptr, nullptr, 0 }")
+    lines.append("};")
+    lines.append("")
+
+    content = "\n".join(lines)
+    # do not touch an unchanged header, it would trigger a full rebuild
+    if os.path.isfile(out_path):
+        with open(out_path) as f:
+            if f.read() == content:
+                return
+    os.makedirs(os.path.dirname(os.path.abspath(out_path)), exist_ok=True)
+    with open(out_path, "w") as f:
+        f.write(content)
+    print("mkassets: %d assets written to %s" % (len(assets), out_path))
+
+
+try:
+    Import("env")  # noqa: F821 (defined when run as PlatformIO extra script)
+    generate(env.subst("$PROJECT_DATA_DIR"),  # noqa: F821
+             os.path.join(env.subst("$PROJECT_INCLUDE_DIR"), "EspAssets.h"),  # noqa: F821
+             DEFAULT_FILES)
+except NameError:
+    if __name__ == "__main__":
+        if len(sys.argv) < 3:
+            print("usage: mkassets.py <data dir> <output header> [file ...]")
+            sys.exit(1)
+        generate(sys.argv[1], sys.argv[2], sys.argv[3:] or DEFAULT_FILES)
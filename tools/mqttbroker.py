@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+#=======================================================================
+# mqttbroker.py Arduino EspSetup library ESP8266 / ESP32
+# Minimal MQTT 3.1.1 broker (QoS 0/1, retained messages are not kept) as local
+# stand-in to try MqttService of EspSetup without a real broker. Every packet
+# is logged; --drop N closes each client connection when its Nth packet arrives,
+# that packet stays unanswered, to check the reconnect and QoS 1 resend behaviour.
+# A PUBLISH to broker/inject makes the broker send every --inject topic to that
+# client, subscribed or not (payload is the topic), to check the client's matching.
+#
+# python tools/mqttbroker.py [--port 1883] [--drop N] [--inject TOPIC ...]
+# Licence: https://www.gnu.org/licenses/gpl-3.0
+#=======================================================================
+
+import argparse
+import socketserver
+import struct
+import threading
+
+clients = {}                # handler -> list of (filter, qos)
+lock = threading.Lock()
+
+
+def matches(filt, topic):
+    f = filt.split("/")
+    t = topic.split("/")
+    if topic.startswith("$") and f[0] in ("+", "#"):
+        return False
+    for i, level in enumerate(f):
+        if level == "#":
+            return True
+        if i >= len(t) or (level != "+" and level != t[i]):
+            return False
+    return len(f) == len(t)
+
+
+def packet(header, body):
+    out = bytearray([header])
+    n = len(body)
+    while True:
+        b = n & 0x7F
+        n >>= 7
+        out.append(b | (0x80 if n else 0))
+        if not n:
+            break
+    return bytes(out) + body
+
+
+def mqtt_string(data, pos):
+    n, = struct.unpack_from(">H", data, pos)
+    return data[pos + 2:pos + 2 + n].decode(errors="replace"), pos + 2 + n
+
+
+class Handler(socketserver.BaseRequestHandler):
+    def read_packet(self):
+        head = self.request.recv(1)
+        if not head:
+            return None, None
+        n = shift = 0
+        while True:
+            b = self.request.recv(1)[0]
+            n |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                break
+        body = b""
+        while len(body) < n:
+            chunk = self.request.recv(n - len(body))
+            if not chunk:
+                return None, None
+            body += chunk
+        return head[0], body
+
+    def send(self, data):
+        with lock:
+            self.request.sendall(data)
+
+    def handle(self):
+        peer = "%s:%d" % self.client_address
+        count = 0
+        try:
+            while True:
+                header, body = self.read_packet()
+                if header is None:
+                    break
+                count += 1
+                if self.server.drop and count >= self.server.drop:
+                    print("%s dropped at packet %d" % (peer, count))
+                    break
+                kind = header >> 4
+                if kind == 1:
+                    _, pos = mqtt_string(body, 0)
+                    client_id, _ = mqtt_string(body, pos + 4)
+                    print("%s CONNECT %s" % (peer, client_id))
+                    with lock:
+                        clients[self] = []
+                    self.send(packet(0x20, b"\0\0"))
+                elif kind == 3:
+                    qos = (header >> 1) & 3
+                    topic, pos = mqtt_string(body, 0)
+                    dup = " DUP" if header & 0x08 else ""
+                    if qos:
+                        pid, = struct.unpack_from(">H", body, pos)
+                        pos += 2
+                        self.send(packet(0x40, struct.pack(">H", pid)))
+                    payload = body[pos:]
+                    print("%s PUBLISH%s qos %d %s %r" % (peer, dup, qos, topic, payload[:60]))
+                    with lock:
+                        targets = [h for h, subs in clients.items() if any(matches(f, topic) for f, _ in subs)]
+                    for h in targets:
+                        h.send(packet(0x30, struct.pack(">H", len(topic)) + topic.encode() + payload))
+                    if topic == "broker/inject":
+                        for t in self.server.inject:
+                            print("%s INJECT %s" % (peer, t))
+                            self.send(packet(0x30, struct.pack(">H", len(t)) + t.encode() + t.encode()))
+                elif kind == 8:
+                    pid, = struct.unpack_from(">H", body, 0)
+                    pos, granted = 2, b""
+                    while pos < len(body):
+                        filt, pos = mqtt_string(body, pos)
+                        granted += bytes([min(body[pos], 1)])
+                        pos += 1
+                        with lock:
+                            clients[self].append((filt, 0))
+                        print("%s SUBSCRIBE %s" % (peer, filt))
+                    self.send(packet(0x90, struct.pack(">H", pid) + granted))
+                elif kind == 12:
+                    self.send(packet(0xD0, b""))
+                elif kind == 14:
+                    break
+        except (ConnectionError, IndexError):
+            pass
+        with lock:
+            clients.pop(self, None)
+        print("%s closed" % peer)
+
+
+class Server(socketserver.ThreadingTCPServer):
+    allow_reuse_address = True
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MQTT stand-in broker for EspSetup")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--drop", type=int, default=0, help="close connections at their Nth packet")
+    parser.add_argument("--inject", action="append", default=[], metavar="TOPIC",
+                        help="sent to a client that publishes to broker/inject")
+    args = parser.parse_args()
+    with Server(("", args.port), Handler) as server:
+        server.drop = args.drop
+        server.inject = args.inject
+        print("listening on port %d" % args.port)
+        server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()